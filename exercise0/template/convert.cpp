@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "include/op_stream.hpp"
+#include "include/reader.hpp"
+
+/**
+ * Helper function to ouput usage information when the -h flag is detected
+ */
+void help() {
+    std::cout << R"(
+Converts text operation files to the binary operation stream format read by ./query -b.
+
+usage:
+    ./convert [options] [input file] [output file]
+
+Options:
+-h             Outputs this message and terminates.
+-w <number>    Bytes per value, 4 or 8. Defaults to the smallest width that fits all values.
+<input file>   Text file with operations, as accepted by ./query. The markers are kept:
+               -1 switches between insertions and queries, -2 starts erasures and
+               -3, -4 and -5 the second set of a union, intersection or difference.
+               If no input file is specified standard input will be used.
+<output file>  File to write the binary stream to.
+               If no output file is specified standard output will be used.
+
+Example:
+   ./convert ../test_data/data.txt data.bin
+         Convert the default data set.)"
+              << std::endl;
+}
+
+/**
+ * Reads all operations from in into a binary stream builder.
+ *
+ * Values are read as 64-bit integers so that the converter also works for
+ * inputs that do not fit into an int.
+ */
+void read_ops(pfp::reader<int64_t>& in, pfp::op_stream_writer& ops) {
+    int64_t val;
+    pfp::token t;
+    while ((t = in.next(val)) != pfp::token::end) {
+        if (t == pfp::token::value) {
+            ops.value(val);
+        } else {
+            ops.marker(val);
+        }
+    }
+}
+
+int main(int argc, char const* argv[]) {
+    unsigned width = 0;
+    const char* input_file = nullptr;
+    const char* output_file = nullptr;
+    int i = 1;
+    while (i < argc) {
+        std::string s(argv[i++]);
+        if (s.compare("-w") == 0) {
+            width = std::stoul(argv[i++]);
+        } else if (s.compare("-h") == 0) {
+            help();
+            exit(0);
+        } else if (input_file == nullptr) {
+            input_file = argv[i - 1];
+        } else {
+            output_file = argv[i - 1];
+        }
+    }
+
+    pfp::op_stream_writer ops;
+    if (input_file != nullptr) {
+        pfp::reader<int64_t> in(input_file);
+        if (!in.ok()) {
+            std::cerr << "Could not open " << input_file << std::endl;
+            exit(1);
+        }
+        read_ops(in, ops);
+    } else {
+        pfp::reader<int64_t> in(STDIN_FILENO);
+        read_ops(in, ops);
+    }
+
+    int fd = STDOUT_FILENO;
+    if (output_file != nullptr) {
+        fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Could not open " << output_file << std::endl;
+            exit(1);
+        }
+    }
+    if (!ops.write(fd, width)) {
+        std::cerr << "Writing the binary stream failed" << std::endl;
+        exit(1);
+    }
+    if (fd != STDOUT_FILENO) close(fd);
+    return 0;
+}
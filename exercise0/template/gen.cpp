@@ -0,0 +1,532 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "include/op_stream.hpp"
+#include "include/writer.hpp"
+
+/**
+ * Helper function to ouput usage information when the -h flag is detected
+ */
+void help() {
+    std::cout << R"(
+Generates benchmark data for problem set 0 of programming for perfomance, like nums.py but
+at disk speed and with more kinds of workloads. Writes text (as read by ./main) or binary
+operation streams (as read by ./main -b, see include/op_stream.hpp).
+
+usage:
+    ./gen [options] [output file]
+
+Options:
+-h             Outputs this message and terminates.
+-n <number>    Number of insertions and of queries to generate. Defaults to 10^6.
+-m <number>    Highest permitted value, at most 2^63 - 1. Defaults to 2^31 - 1.
+-d <dist>      Distribution of the values:
+               uniform  Every value from 0 to -m is equally likely (default, like nums.py).
+               zipf     The k-th most common value comes up with probability
+                        proportional to 1 / k^z. The common values are spread out
+                        over the whole range.
+               cluster  Values are close to one of -c randomly placed centers.
+-z <number>    Exponent of the zipf distribution, larger than 0. Defaults to 1.
+-c <number>    Number of clusters of the cluster distribution. Defaults to 16. Every
+               cluster spans 1 / (64 c) of the range.
+-u <fraction>  Fraction of the insertions that repeat an earlier insertion. Defaults to 0.
+-q <fraction>  Fraction of the queries that ask for a value inserted before them (a hit).
+               The other queries are drawn from the distribution, and for a range much
+               larger than -n almost never hit. Without -q every query is drawn from the
+               distribution, like nums.py.
+-o <order>     Order of the insertions:
+               random    As drawn (default).
+               sorted    Increasing, like nums.py -s.
+               reversed  Decreasing.
+               zigzag    Alternately the smallest and the largest value that is left.
+               All but random make the unbalanced binary tree (-t 3) a linked list.
+-s             Same as -o sorted.
+-i             Interleave insertions and queries. After every operation the next one
+               switches between insertion and query with probability 1/2, like nums.py -i.
+-b             Write a binary operation stream instead of text.
+-w <number>    Bytes per value of binary streams, 4 or 8. Defaults to 4 if -m fits.
+-r <number>    Seed for the random number generator. Defaults to a random seed.
+<output file>  File to write to. If no output file is specified standard output will be
+               used.
+
+Examples:
+   ./gen -r 1337 > data.txt
+         Uniform insertions followed by uniform queries.
+
+   ./gen -n 50000000 -d zipf -z 1.2 -i -b zipf.bin
+         100 million interleaved operations on zipf distributed values, as a binary stream.
+
+   ./gen -u 0.5 -q 0.9 -m 1000000 dups.txt
+         Insertions with many duplicates, and queries that mostly hit.)"
+              << std::endl;
+}
+
+/**
+ * Order of the insertions.
+ */
+enum class order { random, sorted, reversed, zigzag };
+
+/**
+ * Distribution of the values.
+ */
+enum class dist { uniform, zipf, cluster };
+
+struct options {
+    uint64_t n = 1000000;
+    uint64_t limit = (uint64_t(1) << 31) - 1;
+    dist d = dist::uniform;
+    double zipf_exponent = 1;
+    uint64_t clusters = 16;
+    double duplicates = 0;
+    // Negative for queries drawn from the distribution.
+    double hits = -1;
+    order o = order::random;
+    bool interleave = false;
+    bool binary = false;
+    unsigned width = 0;
+    uint64_t seed = std::random_device()();
+};
+
+/**
+ * Fast pseudo random numbers. std::uniform_int_distribution and friends are
+ * more general, but noticeably slower when called a few hundred million
+ * times.
+ */
+class rng {
+   private:
+    std::mt19937_64 gen_;
+
+   public:
+    explicit rng(uint64_t seed) : gen_(seed) {}
+
+    /**
+     * @return A value in [0, n), with n at least 1.
+     */
+    uint64_t below(uint64_t n) {
+        // The high word of a 64 x 64 bit product is a value in [0, n) with
+        // negligible bias and without a division.
+        __extension__ typedef unsigned __int128 u128;
+        return uint64_t((u128(gen_()) * n) >> 64);
+    }
+
+    /**
+     * @return A value in [0, 1).
+     */
+    double unit() { return (gen_() >> 11) * 0x1.0p-53; }
+
+    bool coin() { return gen_() >> 63; }
+};
+
+/**
+ * Zipf distributed ranks in [1, n] by rejection inversion (W. Hormann and
+ * G. Derflinger, "Rejection-inversion to generate variates from monotone
+ * discrete distributions", 1996). Takes a constant expected number of steps
+ * for any n, where the usual inversion of the cumulative probabilities needs
+ * a table of n entries.
+ */
+class zipf_ranks {
+   private:
+    double n_;
+    double s_;
+    double h_x1_;
+    double h_n_;
+    double cut_;
+
+    // log(1 + x) / x and (exp(x) - 1) / x, without the cancellation near 0.
+    static double helper1(double x) {
+        return std::abs(x) > 1e-8 ? std::log1p(x) / x
+                                  : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+    }
+
+    static double helper2(double x) {
+        return std::abs(x) > 1e-8
+                   ? std::expm1(x) / x
+                   : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+    }
+
+    // The hat function h(x) = x^-s, its integral and the inverse of that.
+    double h(double x) const { return std::exp(-s_ * std::log(x)); }
+
+    double h_integral(double x) const {
+        double log_x = std::log(x);
+        return helper2((1 - s_) * log_x) * log_x;
+    }
+
+    double h_integral_inverse(double x) const {
+        double t = std::max(-1.0, x * (1 - s_));
+        return std::exp(helper1(t) * x);
+    }
+
+   public:
+    /**
+     * @param n Number of ranks.
+     * @param s Exponent, larger than 0.
+     */
+    zipf_ranks(uint64_t n, double s)
+        : n_(double(n)),
+          s_(s),
+          h_x1_(h_integral(1.5) - 1),
+          h_n_(h_integral(n_ + 0.5)),
+          cut_(2 - h_integral_inverse(h_integral(2.5) - h(2))) {}
+
+    uint64_t operator()(rng& r) const {
+        while (true) {
+            double u = h_n_ + r.unit() * (h_x1_ - h_n_);
+            double x = h_integral_inverse(u);
+            double k = std::min(n_, std::max(1.0, std::floor(x + 0.5)));
+            if (k - x <= cut_ || u >= h_integral(k + 0.5) - h(k)) {
+                return uint64_t(k);
+            }
+        }
+    }
+};
+
+/**
+ * Draws values in [0, limit] from the distribution of the options.
+ */
+class value_source {
+   private:
+    dist d_;
+    uint64_t limit_;
+    zipf_ranks zipf_;
+    // Multiplier that maps zipf ranks to values, a number coprime to
+    // limit + 1 so that different ranks get different values.
+    uint64_t spread_ = 1;
+    std::vector<uint64_t> centers_;
+    uint64_t width_ = 1;
+
+   public:
+    value_source(const options& opt, rng& r)
+        : d_(opt.d),
+          limit_(opt.limit),
+          zipf_(opt.limit + 1, opt.zipf_exponent) {
+        uint64_t range = limit_ + 1;
+        spread_ = 0x9e3779b97f4a7c15ULL % range;
+        while (std::gcd(spread_, range) != 1) ++spread_;
+        centers_.resize(opt.clusters);
+        for (uint64_t& c : centers_) c = r.below(range);
+        width_ = std::max<uint64_t>(1, range / (64 * opt.clusters));
+    }
+
+    uint64_t operator()(rng& r) const {
+        if (d_ == dist::zipf) {
+            __extension__ typedef unsigned __int128 u128;
+            return uint64_t(u128(zipf_(r) - 1) * spread_ % (limit_ + 1));
+        }
+        if (d_ == dist::cluster) {
+            uint64_t c = centers_[r.below(centers_.size())];
+            return std::min(limit_, c + r.below(width_));
+        }
+        return r.below(limit_ + 1);
+    }
+};
+
+/**
+ * Draws the insertions and puts them in the order of the options.
+ */
+std::vector<uint64_t> make_insertions(const options& opt, rng& r,
+                                      const value_source& values) {
+    std::vector<uint64_t> ins(opt.n);
+    for (uint64_t i = 0; i < opt.n; ++i) {
+        if (i > 0 && opt.duplicates > 0 && r.unit() < opt.duplicates) {
+            ins[i] = ins[r.below(i)];
+        } else {
+            ins[i] = values(r);
+        }
+    }
+    if (opt.o == order::random) return ins;
+    std::sort(ins.begin(), ins.end());
+    if (opt.o == order::reversed) std::reverse(ins.begin(), ins.end());
+    if (opt.o == order::zigzag) {
+        std::vector<uint64_t> zz;
+        zz.reserve(ins.size());
+        size_t lo = 0;
+        size_t hi = ins.size();
+        while (lo < hi) {
+            zz.push_back(ins[lo++]);
+            if (lo < hi) zz.push_back(ins[--hi]);
+        }
+        ins.swap(zz);
+    }
+    return ins;
+}
+
+/**
+ * Decides which runs of insertions and queries the stream has, as run
+ * descriptors of the binary format (see include/op_stream.hpp).
+ */
+std::vector<uint64_t> make_runs(const options& opt, rng& r) {
+    std::vector<uint64_t> runs;
+    auto add = [&](pfp::op o, uint64_t n) {
+        if (runs.empty() ||
+            pfp::op(runs.back() >> pfp::detail::op_shift) != o) {
+            runs.push_back(uint64_t(o) << pfp::detail::op_shift);
+        }
+        runs.back() += n;
+    };
+    if (!opt.interleave) {
+        if (opt.n > 0) add(pfp::op::insert, opt.n);
+        if (opt.n > 0) add(pfp::op::query, opt.n);
+        return runs;
+    }
+    uint64_t inserted = 0;
+    uint64_t queried = 0;
+    pfp::op mode = pfp::op::insert;
+    while (inserted < opt.n && queried < opt.n) {
+        add(mode, 1);
+        ++(mode == pfp::op::insert ? inserted : queried);
+        if (r.coin()) {
+            mode = mode == pfp::op::insert ? pfp::op::query : pfp::op::insert;
+        }
+    }
+    if (queried < opt.n) add(pfp::op::query, opt.n - queried);
+    return runs;
+}
+
+/**
+ * Writes text operations, with a -1 line before every run that switches
+ * the operation.
+ */
+class text_sink {
+   private:
+    pfp::writer out_;
+    pfp::op mode_ = pfp::op::insert;
+
+   public:
+    explicit text_sink(int fd) : out_(fd) {}
+
+    void run(pfp::op o) {
+        if (o != mode_) out_.put_text("-1\n", 3);
+        mode_ = o;
+    }
+
+    void value(uint64_t v) { out_.put_number(v); }
+
+    bool finish() {
+        out_.flush();
+        return true;
+    }
+};
+
+/**
+ * Writes a binary operation stream. The header and the run descriptors are
+ * known before the first value, except for the highest value: it is filled
+ * in at the end if the output is a file, and otherwise the limit of the
+ * options is used.
+ *
+ * @tparam word uint32_t or uint64_t, the type of the stored values.
+ */
+template <class word>
+class binary_sink {
+   private:
+    static constexpr size_t buffer_size = size_t(1) << 16;
+
+    int fd_;
+    off_t start_;
+    std::vector<word> buf_;
+    uint64_t n_ = 0;
+    uint64_t max_ = 0;
+    bool ok_;
+
+    void spill() {
+        ok_ = ok_ && pfp::detail::write_all(fd_, buf_.data(),
+                                            buf_.size() * sizeof(word));
+        buf_.clear();
+    }
+
+   public:
+    binary_sink(int fd, uint64_t n, uint64_t limit,
+                const std::vector<uint64_t>& runs)
+        : fd_(fd), start_(lseek(fd, 0, SEEK_CUR)) {
+        uint64_t header[pfp::detail::op_header_words] = {n, limit, sizeof(word),
+                                                         runs.size()};
+        ok_ = pfp::detail::write_all(fd_, header, sizeof(header)) &&
+              pfp::detail::write_all(fd_, runs.data(), runs.size() * 8);
+        buf_.reserve(buffer_size);
+    }
+
+    void run(pfp::op) {}
+
+    void value(uint64_t v) {
+        buf_.push_back(word(v));
+        max_ = std::max(max_, v);
+        ++n_;
+        if (buf_.size() == buffer_size) [[unlikely]] {
+            spill();
+        }
+    }
+
+    /**
+     * @return false iff writing failed.
+     */
+    bool finish() {
+        if (n_ * sizeof(word) % 8 != 0) buf_.push_back(0);
+        spill();
+        if (ok_ && start_ >= 0) {
+            ok_ = pwrite(fd_, &max_, 8, start_ + 8) == 8;
+        }
+        return ok_;
+    }
+};
+
+/**
+ * Writes the stream: the insertions in order, and the queries drawn as they
+ * come up, so that hits can only ask for values inserted before them.
+ */
+template <class sink>
+bool emit(const options& opt, rng& r, const value_source& values,
+          const std::vector<uint64_t>& ins, const std::vector<uint64_t>& runs,
+          sink& out) {
+    uint64_t inserted = 0;
+    for (uint64_t d : runs) {
+        pfp::op o = pfp::op(d >> pfp::detail::op_shift);
+        uint64_t n = d & pfp::detail::run_length_mask;
+        out.run(o);
+        if (o == pfp::op::insert) {
+            for (uint64_t i = 0; i < n; ++i) out.value(ins[inserted++]);
+            continue;
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            if (opt.hits >= 0 && inserted > 0 && r.unit() < opt.hits) {
+                out.value(ins[r.below(inserted)]);
+            } else {
+                out.value(values(r));
+            }
+        }
+    }
+    return out.finish();
+}
+
+/**
+ * Parses a fraction for -u and -q and stops if it is not in [0, 1].
+ */
+double fraction(const char* arg, const char* flag) {
+    double f = std::stod(arg);
+    if (!(f >= 0 && f <= 1)) {
+        std::cerr << flag << " needs a number from 0 to 1" << std::endl;
+        exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char const* argv[]) {
+    options opt;
+    const char* output_file = nullptr;
+    int i = 1;
+    while (i < argc) {
+        std::string s(argv[i++]);
+        if (i < argc && s.compare("-n") == 0) {
+            opt.n = std::stoull(argv[i++]);
+        } else if (i < argc && s.compare("-m") == 0) {
+            opt.limit = std::stoull(argv[i++]);
+        } else if (i < argc && s.compare("-d") == 0) {
+            std::string d(argv[i++]);
+            if (d.compare("uniform") == 0) {
+                opt.d = dist::uniform;
+            } else if (d.compare("zipf") == 0) {
+                opt.d = dist::zipf;
+            } else if (d.compare("cluster") == 0) {
+                opt.d = dist::cluster;
+            } else {
+                std::cerr << "Unknown distribution " << d << std::endl;
+                exit(1);
+            }
+        } else if (i < argc && s.compare("-z") == 0) {
+            opt.zipf_exponent = std::stod(argv[i++]);
+        } else if (i < argc && s.compare("-c") == 0) {
+            opt.clusters = std::stoull(argv[i++]);
+        } else if (i < argc && s.compare("-u") == 0) {
+            opt.duplicates = fraction(argv[i++], "-u");
+        } else if (i < argc && s.compare("-q") == 0) {
+            opt.hits = fraction(argv[i++], "-q");
+        } else if (i < argc && s.compare("-o") == 0) {
+            std::string o(argv[i++]);
+            if (o.compare("random") == 0) {
+                opt.o = order::random;
+            } else if (o.compare("sorted") == 0) {
+                opt.o = order::sorted;
+            } else if (o.compare("reversed") == 0) {
+                opt.o = order::reversed;
+            } else if (o.compare("zigzag") == 0) {
+                opt.o = order::zigzag;
+            } else {
+                std::cerr << "Unknown order " << o << std::endl;
+                exit(1);
+            }
+        } else if (s.compare("-s") == 0) {
+            opt.o = order::sorted;
+        } else if (s.compare("-i") == 0) {
+            opt.interleave = true;
+        } else if (s.compare("-b") == 0) {
+            opt.binary = true;
+        } else if (i < argc && s.compare("-w") == 0) {
+            opt.width = std::stoul(argv[i++]);
+        } else if (i < argc && s.compare("-r") == 0) {
+            opt.seed = std::stoull(argv[i++]);
+        } else if (s.compare("-h") == 0) {
+            help();
+            exit(0);
+        } else {
+            output_file = argv[i - 1];
+        }
+    }
+    // Negative numbers are markers in the text format.
+    if (opt.limit > uint64_t(INT64_MAX)) {
+        std::cerr << "-m can be at most 2^63 - 1" << std::endl;
+        exit(1);
+    }
+    if (!(opt.zipf_exponent > 0) || opt.clusters == 0) {
+        std::cerr << "-z and -c have to be larger than 0" << std::endl;
+        exit(1);
+    }
+    if (opt.width == 0) opt.width = opt.limit > UINT32_MAX ? 8 : 4;
+    if ((opt.width != 4 && opt.width != 8) ||
+        (opt.width == 4 && opt.limit > UINT32_MAX)) {
+        std::cerr << "-w has to be 8, or 4 if -m is below 2^32" << std::endl;
+        exit(1);
+    }
+
+    int fd = STDOUT_FILENO;
+    if (output_file != nullptr) {
+        fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Could not open " << output_file << std::endl;
+            exit(1);
+        }
+    }
+
+    rng r(opt.seed);
+    value_source values(opt, r);
+    std::vector<uint64_t> ins = make_insertions(opt, r, values);
+    std::vector<uint64_t> runs = make_runs(opt, r);
+    // Interleaved streams end with the queries that are left, and leave
+    // out the insertions that are left, like nums.py -i.
+    uint64_t total = 0;
+    for (uint64_t d : runs) total += d & pfp::detail::run_length_mask;
+    bool ok;
+    if (!opt.binary) {
+        text_sink out(fd);
+        ok = emit(opt, r, values, ins, runs, out);
+    } else if (opt.width == 4) {
+        binary_sink<uint32_t> out(fd, total, opt.limit, runs);
+        ok = emit(opt, r, values, ins, runs, out);
+    } else {
+        binary_sink<uint64_t> out(fd, total, opt.limit, runs);
+        ok = emit(opt, r, values, ins, runs, out);
+    }
+    if (!ok) {
+        std::cerr << "Writing the output failed" << std::endl;
+        exit(1);
+    }
+    if (fd != STDOUT_FILENO) close(fd);
+    return 0;
+}
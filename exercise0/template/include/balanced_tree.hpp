@@ -0,0 +1,395 @@
+/**
+ * Self-balancing binary search tree with non-recursive operations.
+ *
+ * The unbalanced pfp::binary_tree degenerates into a linked list for sorted
+ * input: every insertion walks (and recurses through) the whole tree. Here
+ * the shape of the tree is kept logarithmic by a balancing policy, and both
+ * insert and lookup are plain loops. Insertion remembers the path it took in
+ * a small array so that the balancing step can walk back up without parent
+ * links or recursion. Erasure does the same.
+ *
+ * Balancing policies:
+ *
+ * pfp::avl    Heights of sibling subtrees differ by at most one. The tree is
+ *             at most ~1.44 log2(n) deep, which gives the fastest lookups.
+ * pfp::treap  Each node gets a pseudo random priority and the tree is kept in
+ *             heap order by priority. Expected depth is ~2 ln(n), insertion
+ *             does fewer rotations and needs no height bookkeeping.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "batch.hpp"
+#include "mem_usage.hpp"
+#include "node_alloc.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+/**
+ * Rotates the subtree in slot so that its child in direction dir becomes
+ * the new subtree root.
+ *
+ * Before, for dir = 1:    After:
+ *
+ *       x                     y
+ *      / \                   / \
+ *     a   y                 x   c
+ *        / \               / \
+ *       b   c             a   b
+ */
+template <class pool_t, class ref>
+inline void rotate(pool_t& pool, ref& slot, int dir) {
+    ref x = slot;
+    ref y = pool.get(x).child[dir];
+    pool.get(x).child[dir] = pool.get(y).child[!dir];
+    pool.get(y).child[!dir] = x;
+    slot = y;
+}
+
+}  // namespace detail
+
+/**
+ * AVL balancing. Each node stores the height of its subtree.
+ */
+struct avl {
+    struct tag {
+        int8_t height;
+        template <class dtype>
+        void init(dtype) {
+            height = 1;
+        }
+    };
+
+    template <class pool_t, class ref>
+    static int height(const pool_t& pool, ref r) {
+        return r == pool_t::null ? 0 : pool.get(r).info.height;
+    }
+
+    template <class pool_t, class ref>
+    static void update(pool_t& pool, ref r) {
+        auto& n = pool.get(r);
+        int hl = height(pool, n.child[0]);
+        int hr = height(pool, n.child[1]);
+        n.info.height = int8_t(1 + (hl > hr ? hl : hr));
+    }
+
+    /**
+     * Restores the AVL property at the subtree in slot, assuming both of its
+     * subtrees are valid AVL trees whose heights differ by at most two.
+     */
+    template <class pool_t, class ref>
+    static void rebalance(pool_t& pool, ref& slot) {
+        auto& n = pool.get(slot);
+        int diff = height(pool, n.child[1]) - height(pool, n.child[0]);
+        if (diff > 1 || diff < -1) {
+            // dir is the heavy side.
+            int dir = diff > 0;
+            ref& c = n.child[dir];
+            auto& cn = pool.get(c);
+            if (height(pool, cn.child[!dir]) > height(pool, cn.child[dir])) {
+                // Zig-zag case. Straighten it out first.
+                detail::rotate(pool, c, !dir);
+                update(pool, pool.get(c).child[dir]);
+                update(pool, c);
+            }
+            detail::rotate(pool, slot, dir);
+            update(pool, pool.get(slot).child[!dir]);
+        }
+        update(pool, slot);
+    }
+
+    /**
+     * Walks back up the insertion path, rebalancing as needed. Stops as soon
+     * as a subtree keeps the height it had before the insertion, since
+     * nothing above it can have changed.
+     *
+     * @param path  Slots (root pointer or child links) on the way down.
+     * @param dirs  Direction taken from each slot on the path.
+     * @param depth Length of the path.
+     */
+    template <class pool_t, class ref>
+    static void fixup(pool_t& pool, ref** path, const uint8_t*, int depth) {
+        while (depth > 0) {
+            ref& slot = *path[--depth];
+            int before = pool.get(slot).info.height;
+            rebalance(pool, slot);
+            if (pool.get(slot).info.height == before) break;
+        }
+    }
+
+    /**
+     * Unlinks the node in slot, which is at the end of the path. A node
+     * with two children takes the value of the smallest node of its right
+     * subtree, which is unlinked instead. Then the path is rebalanced like
+     * after an insertion, which also stops once a subtree has kept its
+     * height.
+     *
+     * @return The node that is no longer in the tree.
+     */
+    template <class pool_t, class ref>
+    static ref remove(pool_t& pool, ref* slot, ref** path, uint8_t*,
+                      int depth) {
+        auto& n = pool.get(*slot);
+        if (n.child[0] != pool_t::null && n.child[1] != pool_t::null) {
+            path[depth++] = slot;
+            ref* next = &n.child[1];
+            while (pool.get(*next).child[0] != pool_t::null) {
+                path[depth++] = next;
+                next = &pool.get(*next).child[0];
+            }
+            n.val = pool.get(*next).val;
+            slot = next;
+        }
+        ref r = *slot;
+        auto& d = pool.get(r);
+        *slot = d.child[d.child[0] == pool_t::null];
+        fixup(pool, path, nullptr, depth);
+        return r;
+    }
+};
+
+/**
+ * Treap balancing. Priorities are a hash of the value, so no random number
+ * generator state is needed and the shape of the tree only depends on the set
+ * of values, not the order they were inserted in.
+ */
+struct treap {
+    struct tag {
+        uint32_t priority;
+        template <class dtype>
+        void init(dtype value) {
+            // Murmur3 finalizer.
+            uint64_t h = uint64_t(value);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            priority = uint32_t(h);
+        }
+    };
+
+    /**
+     * Rotates the new node up the insertion path as long as its priority is
+     * higher than its parent's.
+     */
+    template <class pool_t, class ref>
+    static void fixup(pool_t& pool, ref** path, const uint8_t* dirs,
+                      int depth) {
+        while (depth > 0) {
+            ref& slot = *path[--depth];
+            ref c = pool.get(slot).child[dirs[depth]];
+            if (pool.get(c).info.priority <= pool.get(slot).info.priority) {
+                break;
+            }
+            detail::rotate(pool, slot, dirs[depth]);
+        }
+    }
+
+    /**
+     * Rotates the node in slot down, always lifting the child with the
+     * higher priority, until it has at most one child and can be unlinked.
+     * The heap order of the rest of the tree is never violated.
+     *
+     * @return The node that is no longer in the tree.
+     */
+    template <class pool_t, class ref>
+    static ref remove(pool_t& pool, ref* slot, ref**, uint8_t*, int) {
+        while (true) {
+            auto& n = pool.get(*slot);
+            if (n.child[0] == pool_t::null || n.child[1] == pool_t::null) {
+                break;
+            }
+            int dir = pool.get(n.child[1]).info.priority >
+                      pool.get(n.child[0]).info.priority;
+            detail::rotate(pool, *slot, dir);
+            slot = &pool.get(*slot).child[!dir];
+        }
+        ref r = *slot;
+        auto& d = pool.get(r);
+        *slot = d.child[d.child[0] == pool_t::null];
+        return r;
+    }
+};
+
+/**
+ * @tparam dtype   Type of integer this tree stores.
+ * @tparam balance Balancing policy, pfp::avl or pfp::treap.
+ * @tparam alloc   Node allocator template. Defaults to 32-bit indices in an
+ *                 arena, see node_alloc.hpp.
+ */
+template <class dtype, class balance = avl,
+          template <class> class alloc = index_alloc>
+class balanced_tree {
+   private:
+    // Deep enough for any AVL tree that fits in memory (an AVL tree of depth
+    // 64 has more than 2^44 nodes). The expected depth of a treap is about
+    // 2 ln(n), so exceeding this is astronomically unlikely there as well.
+    static constexpr int max_depth = 128;
+
+    struct node;
+    using pool_t = alloc<node>;
+    using ref = typename pool_t::ref;
+
+    /**
+     * child[0] is the left and child[1] the right subtree, which lets
+     * rotations and the balancing policies handle both directions with the
+     * same code.
+     */
+    struct node {
+        dtype val;
+        ref child[2] = {pool_t::null, pool_t::null};
+        typename balance::tag info;
+
+        node(dtype value) : val(value) { info.init(value); }
+    };
+
+    pool_t pool;
+    ref root = pool_t::null;
+
+    void free_subtree(ref n) {
+        // Only used with heap_alloc. Recursion depth is bounded by the
+        // (logarithmic) height of the tree.
+        if (n == pool_t::null) return;
+        free_subtree(pool.get(n).child[0]);
+        free_subtree(pool.get(n).child[1]);
+        pool.release(n);
+    }
+
+   public:
+    balanced_tree() {}
+
+    ~balanced_tree() {
+        if constexpr (!pool_t::bulk_free) free_subtree(root);
+    }
+
+    balanced_tree(const balanced_tree&) = delete;
+    balanced_tree& operator=(const balanced_tree&) = delete;
+    balanced_tree(balanced_tree&&) = delete;
+    balanced_tree& operator=(balanced_tree&&) = delete;
+
+    /**
+     * Inserts value if it is not already present.
+     *
+     * @param value Element to be inserted.
+     */
+    void insert(dtype value) {
+        ref* path[max_depth];
+        uint8_t dirs[max_depth];
+        int depth = 0;
+        ref* slot = &root;
+        while (*slot != pool_t::null) {
+            node& n = pool.get(*slot);
+            if (n.val == value) [[unlikely]] {
+                return;
+            }
+            uint8_t dir = value > n.val;
+            path[depth] = slot;
+            dirs[depth++] = dir;
+            slot = &n.child[dir];
+        }
+        // Nodes never move once allocated, so slot stays valid.
+        *slot = pool.make(value);
+        balance::fixup(pool, path, dirs, depth);
+    }
+
+    /**
+     * Removes value if it is present.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        ref* path[max_depth];
+        uint8_t dirs[max_depth];
+        int depth = 0;
+        ref* slot = &root;
+        while (*slot != pool_t::null) {
+            node& n = pool.get(*slot);
+            if (n.val == value) [[unlikely]] {
+                pool.release(balance::remove(pool, slot, path, dirs, depth));
+                return;
+            }
+            uint8_t dir = value > n.val;
+            path[depth] = slot;
+            dirs[depth++] = dir;
+            slot = &n.child[dir];
+        }
+    }
+
+    /**
+     * Calls f(value) for every value in the tree, in increasing order.
+     */
+    template <class F>
+    void for_each(F f) const {
+        std::vector<ref> stack;
+        ref r = root;
+        while (r != pool_t::null || !stack.empty()) {
+            while (r != pool_t::null) {
+                stack.push_back(r);
+                r = pool.get(r).child[0];
+            }
+            r = stack.back();
+            stack.pop_back();
+            f(pool.get(r).val);
+            r = pool.get(r).child[1];
+        }
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the tree, otherwise 0.
+     */
+    int count(dtype value) const {
+        ref r = root;
+        while (r != pool_t::null) {
+            const node& n = pool.get(r);
+            if (n.val == value) [[unlikely]] {
+                return 1;
+            }
+            r = n.child[value > n.val];
+        }
+        return 0;
+    }
+
+    /**
+     * @return Bytes the tree takes (see include/mem_usage.hpp), with all
+     *         nodes of the allocator.
+     */
+    size_t bytes_used() const { return sizeof(*this) + pool.heap_bytes(); }
+
+    /**
+     * Batched count, see batch.hpp. 16 searches walk down the tree
+     * interleaved, each prefetching its next node.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        detail::interleave<16, ref>(
+            n,
+            [&](size_t i, ref& r) {
+                r = root;
+                out[i] = 0;
+            },
+            [&](size_t i, ref& r) {
+                if (r == pool_t::null) return true;
+                const node& nd = pool.get(r);
+                if (nd.val == vals[i]) [[unlikely]] {
+                    out[i] = 1;
+                    return true;
+                }
+                r = nd.child[vals[i] > nd.val];
+                if (r != pool_t::null) __builtin_prefetch(&pool.get(r));
+                return false;
+            });
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,106 @@
+/**
+ * Batched membership queries.
+ *
+ * Answering queries one at a time means that the data structure waits for
+ * every cache miss on its own: the next lookup does not start before the
+ * current one is done. Given a whole batch of independent queries, the
+ * lookups can be interleaved so that several cache misses are in flight at
+ * the same time, with software prefetches issued for the memory each lookup
+ * will touch next.
+ *
+ * Data structures provide this as
+ *
+ *     void count_batch(const dtype* vals, size_t n, uint8_t* out)
+ *
+ * which writes count(vals[i]) to out[i]. pfp::count_batch below calls it if
+ * it exists and falls back to a plain count loop otherwise (e.g. for the
+ * standard library containers).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace pfp {
+
+namespace detail {
+
+template <class qs_t, class dtype, class = void>
+struct has_count_batch : std::false_type {};
+
+template <class qs_t, class dtype>
+struct has_count_batch<
+    qs_t, dtype,
+    decltype(void(std::declval<qs_t&>().count_batch(
+        std::declval<const dtype*>(), size_t(0),
+        std::declval<uint8_t*>())))> : std::true_type {};
+
+/**
+ * Runs n independent searches interleaved, keeping up to lanes of them in
+ * progress at any time. Searches advance one step per round, and each step
+ * can prefetch the memory the next step of that search will need. By the
+ * time a lane is visited again its data is hopefully in the cache. When a
+ * search finishes its lane is immediately refilled with the next one, so
+ * searches of different length (as in an unbalanced tree) do not leave
+ * lanes idle.
+ *
+ * @tparam lanes Number of searches in flight.
+ * @tparam state Per search state, e.g. the current node.
+ *
+ * @param init init(i, s) sets up s for search i.
+ * @param step step(i, s) advances search i by one step. Returns true once
+ *             the search is done and its result has been written.
+ */
+template <unsigned lanes, class state, class init_f, class step_f>
+inline void interleave(size_t n, init_f init, step_f step) {
+    state s[lanes];
+    size_t idx[lanes];
+    size_t next = 0;
+    unsigned active = 0;
+    for (; active < lanes && next < n; ++active, ++next) {
+        idx[active] = next;
+        init(next, s[active]);
+    }
+    while (active > 0) {
+        for (unsigned l = 0; l < active;) {
+            if (!step(idx[l], s[l])) [[likely]] {
+                ++l;
+            } else if (next < n) {
+                idx[l] = next;
+                init(next++, s[l]);
+                ++l;
+            } else {
+                // Move the last lane here and revisit this slot.
+                --active;
+                idx[l] = idx[active];
+                s[l] = s[active];
+            }
+        }
+    }
+}
+
+}  // namespace detail
+
+/**
+ * Writes qs.count(vals[i]) to out[i] for all i < n.
+ *
+ * @param qs   Query structure, non-const since pfp::vs may reorganize itself
+ *             when queried.
+ * @param vals Values to look up.
+ * @param n    Number of values.
+ * @param out  Output for n results.
+ */
+template <class query_structure, class dtype>
+inline void count_batch(query_structure& qs, const dtype* vals, size_t n,
+                        uint8_t* out) {
+    if constexpr (detail::has_count_batch<query_structure, dtype>::value) {
+        qs.count_batch(vals, n, out);
+    } else {
+        for (size_t i = 0; i < n; ++i) out[i] = qs.count(vals[i]);
+    }
+}
+
+}  // namespace pfp
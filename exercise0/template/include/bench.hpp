@@ -0,0 +1,312 @@
+/**
+ * Helpers for the --bench mode of query.cpp.
+ *
+ * Timing a whole run with /usr/bin/time mixes up the cost of parsing the
+ * input, building the data structure, answering the queries and writing the
+ * results. The benchmark mode instead parses the operations into memory once
+ * per repetition and times every phase on its own:
+ *
+ * parse   Reading and tokenizing the input file into an op_list.
+ * insert  Applying only the insertions to an empty data structure.
+ * query   For inputs whose insertions all come first, applying all
+ *         operations in order with the clock started after the insertions.
+ *         Erasures and set operations count as queries here.
+ * query~  For interleaved inputs, applying all operations in order, minus
+ *         the insert time: an estimate of the extra cost of the queries,
+ *         which for very cheap queries can even come out negative.
+ * output  Writing the query results to /dev/null through pfp::writer.
+ *
+ * Timing the queries of interleaved inputs on their own would mean reading
+ * the clock at every switch between inserts and queries, which for
+ * interleaved.txt happens after every second operation on average and
+ * takes longer than the queries themselves.
+ *
+ * Hardware counters are read with perf_event_open(2) when the kernel allows
+ * it. Each counter is opened on its own, so the ones that are not supported
+ * (e.g. hardware counters inside most virtual machines) are simply missing
+ * from the report.
+ */
+
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "batch.hpp"
+#include "op_stream.hpp"
+#include "reader.hpp"
+#include "set_ops.hpp"
+
+namespace pfp {
+
+/**
+ * @return Monotonic time in nanoseconds.
+ */
+inline uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Operations of an input, split into runs of consecutive operations of the
+ * same kind.
+ *
+ * @tparam dtype Type of the values.
+ */
+template <class dtype>
+struct op_list {
+    struct run {
+        op kind;
+        uint64_t length;
+    };
+
+    std::vector<dtype> values;
+    std::vector<run> runs;
+    uint64_t inserts = 0;
+    uint64_t queries = 0;
+
+    /**
+     * Reads all operations from in. Like run_ops, the input starts in insert
+     * mode and the markers switch modes as described at pfp::op_mode. Set
+     * operations keep their runs even when empty.
+     *
+     * @param in pfp::reader or pfp::binary_reader.
+     */
+    template <class input>
+    void load(input& in) {
+        values.clear();
+        runs.clear();
+        inserts = queries = 0;
+        op_mode mode;
+        uint64_t start = 0;
+        dtype val;
+        while (true) {
+            token t = in.next(val);
+            if (t == token::value) [[likely]] {
+                values.push_back(val);
+                continue;
+            }
+            op kind = mode.current();
+            if (values.size() > start || is_set_op(kind)) {
+                runs.push_back({kind, values.size() - start});
+                if (kind == op::insert) inserts += values.size() - start;
+                if (kind == op::query) queries += values.size() - start;
+                start = values.size();
+            }
+            if (t == token::end) return;
+            mode.marker(int64_t(val));
+        }
+    }
+
+    /**
+     * @return true iff no insertion is smaller than the previous one.
+     */
+    bool sorted_inserts() const {
+        const dtype* v = values.data();
+        bool first = true;
+        dtype last = 0;
+        for (const run& r : runs) {
+            if (r.kind == op::insert) {
+                for (uint64_t i = 0; i < r.length; ++i) {
+                    if (!first && v[i] < last) return false;
+                    last = v[i];
+                    first = false;
+                }
+            }
+            v += r.length;
+        }
+        return true;
+    }
+
+    /**
+     * @return true iff no insertion comes after any other operation.
+     */
+    bool inserts_first() const {
+        bool others = false;
+        for (const run& r : runs) {
+            if (r.kind != op::insert) {
+                others = true;
+            } else if (others && r.length > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @return Number of different values that are inserted, the keys of a
+     *         set built by pfp::apply_inserts.
+     */
+    uint64_t distinct_inserts() const {
+        std::vector<dtype> keys;
+        keys.reserve(inserts);
+        const dtype* v = values.data();
+        for (const run& r : runs) {
+            if (r.kind == op::insert) keys.insert(keys.end(), v, v + r.length);
+            v += r.length;
+        }
+        std::sort(keys.begin(), keys.end());
+        return std::unique(keys.begin(), keys.end()) - keys.begin();
+    }
+};
+
+/**
+ * Applies only the insertions of ops to qs.
+ */
+template <class query_structure, class dtype>
+void apply_inserts(query_structure& qs, const op_list<dtype>& ops) {
+    const dtype* v = ops.values.data();
+    for (const auto& r : ops.runs) {
+        if (r.kind == op::insert) {
+            for (uint64_t i = 0; i < r.length; ++i) qs.insert(v[i]);
+        }
+        v += r.length;
+    }
+}
+
+/**
+ * Applies all operations of ops to qs in order.
+ *
+ * @param results    Output for one byte per query. Must have room for
+ *                   ops.queries results.
+ * @param limit      Highest value, for the second sets of set operations.
+ * @param at_queries Called once, before the first operation that is not an
+ *                   insertion (if there is one).
+ * @return Number of queries that were found, which keeps the compiler from
+ *         optimizing the queries away.
+ */
+template <class query_structure, class dtype, class F>
+uint64_t apply_all(query_structure& qs, const op_list<dtype>& ops,
+                   uint8_t* results, uint64_t limit, F&& at_queries) {
+    const dtype* v = ops.values.data();
+    uint64_t found = 0;
+    bool inserting = true;
+    for (const auto& r : ops.runs) {
+        if (inserting && r.kind != op::insert) [[unlikely]] {
+            inserting = false;
+            at_queries();
+        }
+        if (r.kind == op::insert) {
+            for (uint64_t i = 0; i < r.length; ++i) qs.insert(v[i]);
+        } else if (r.kind == op::erase) {
+            for (uint64_t i = 0; i < r.length; ++i) qs.erase(v[i]);
+        } else if (is_set_op(r.kind)) {
+            apply_set_op(qs, r.kind, v, r.length, limit);
+        } else {
+            count_batch(qs, v, r.length, results);
+            for (uint64_t i = 0; i < r.length; ++i) found += results[i];
+            results += r.length;
+        }
+        v += r.length;
+    }
+    return found;
+}
+
+/**
+ * @param samples Measurements, sorted in place.
+ * @param p       Percentile in [0, 100].
+ * @return The nearest rank p-th percentile of samples.
+ */
+inline double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = size_t(p / 100 * samples.size() + 0.999999);
+    if (rank > 0) --rank;
+    return samples[std::min(rank, samples.size() - 1)];
+}
+
+/**
+ * Counters for the calling thread, read with perf_event_open(2).
+ */
+class perf_counters {
+   public:
+    static constexpr unsigned n = 5;
+
+   private:
+    static constexpr const char* names_[n] = {
+        "cycles", "instructions", "cache-misses", "branch-misses",
+        "page-faults"};
+    int fd_[n];
+
+    static int open_counter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        // Page faults are handled by the kernel, so only exclude kernel
+        // time from the hardware counters.
+        attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+        attr.exclude_hv = 1;
+        int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0 && !attr.exclude_kernel) {
+            // Counting in the kernel needs privileges, see
+            // /proc/sys/kernel/perf_event_paranoid.
+            attr.exclude_kernel = 1;
+            fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        return fd;
+    }
+
+   public:
+    perf_counters() {
+        fd_[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fd_[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fd_[2] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fd_[3] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fd_[4] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    }
+
+    ~perf_counters() {
+        for (unsigned i = 0; i < n; ++i) {
+            if (fd_[i] >= 0) close(fd_[i]);
+        }
+    }
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+    perf_counters(perf_counters&&) = delete;
+    perf_counters& operator=(perf_counters&&) = delete;
+
+    /**
+     * @return true iff counter i could be opened.
+     */
+    bool available(unsigned i) const { return fd_[i] >= 0; }
+
+    static const char* name(unsigned i) { return names_[i]; }
+
+    /**
+     * Resets and enables all available counters.
+     */
+    void start() {
+        for (unsigned i = 0; i < n; ++i) {
+            if (fd_[i] < 0) continue;
+            ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    /**
+     * Disables all counters and adds the counts since start() to values.
+     */
+    void stop(uint64_t* values) {
+        for (unsigned i = 0; i < n; ++i) {
+            if (fd_[i] < 0) continue;
+            ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t v = 0;
+            if (read(fd_[i], &v, sizeof(v)) == sizeof(v)) values[i] += v;
+        }
+    }
+};
+
+}  // namespace pfp
@@ -26,6 +26,14 @@
  */
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "batch.hpp"
+#include "mem_usage.hpp"
+#include "node_alloc.hpp"
+
 /**
  * In small projects like this encapsulating things in a separate namespace is
  * not really necessary but a good practice in general.
@@ -52,13 +60,33 @@ namespace pfp {
  * For this project the only type used is "int" so the templating is redundant
  * but good practice for code reusability.
  *
+ * The second template parameter is a template template parameter: instead of
+ * a type it takes a template (like pfp::heap_alloc) which the tree then
+ * instantiates with its own, private, node type. The allocator decides where
+ * nodes live in memory and whether children are linked with pointers or with
+ * 32-bit indices. See node_alloc.hpp.
+ *
  * @tparam dtype Type of integer this tree stores.
+ * @tparam alloc Node allocator template. Defaults to one new per node.
  */
-template <class dtype>
+template <class dtype, template <class> class alloc = heap_alloc>
 class binary_tree {
    private:
     class node;
-    node* root = nullptr;
+    using pool_t = alloc<node>;
+    using ref = typename pool_t::ref;
+    pool_t pool;
+    ref root = pool_t::null;
+
+    /**
+     * Post order traversal that releases every node of a subtree.
+     */
+    void free_subtree(ref n) {
+        if (n == pool_t::null) return;
+        free_subtree(pool.get(n).left);
+        free_subtree(pool.get(n).right);
+        pool.release(n);
+    }
 
    public:
     /**
@@ -75,11 +103,14 @@ class binary_tree {
      * duration of execution, not explicitly deleting any children would be a
      * massive memory leak.
      *
-     * The default destructor would simply deallocate the node itself and
+     * The default destructor would simply deallocate the root node itself and
      * leave any children orphaned in memory.
+     *
+     * With arena allocators all nodes are freed in one go when the allocator
+     * is destroyed, and "if constexpr" removes the traversal completely.
      */
     ~binary_tree() {
-        if (root != nullptr) delete (root);
+        if constexpr (!pool_t::bulk_free) free_subtree(root);
     }
 
     /*
@@ -134,18 +165,18 @@ class binary_tree {
          * condition:
          *
          * if (root != nullptr) {
-         *     root->insert(value);
+         *     pool.get(root).insert(pool, value);
          * } else {
-         *     root = new node(value);
+         *     root = pool.make(value);
          * }
          *
          * However an [[(un)likely]] annotation often leads to more readable
          * code. (And better conveys the intention of the programmer.)
          */
-        if (root == nullptr) [[unlikely]] {
-            root = new node(value);
+        if (root == pool_t::null) [[unlikely]] {
+            root = pool.make(value);
         } else {
-            root->insert(value);
+            pool.get(root).insert(pool, value);
         }
     }
 
@@ -162,7 +193,97 @@ class binary_tree {
      * @return The number of occurrences of value.
      */
     int count(dtype value) const {
-        return root != nullptr ? root->query(value) : false;
+        return root != pool_t::null ? pool.get(root).query(pool, value)
+                                    : false;
+    }
+
+    /**
+     * Removes value from the tree, if it is there. A node with two children
+     * takes the value of the smallest node of its right subtree, and that
+     * node (which has no left child) is removed instead.
+     *
+     * Unlike insert and query this walks down the tree in a loop instead of
+     * recursing through the nodes, since it needs to change the link that
+     * leads to the removed node, which belongs to its parent.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        ref* slot = &root;
+        while (*slot != pool_t::null && pool.get(*slot).val != value) {
+            node& n = pool.get(*slot);
+            slot = value > n.val ? &n.right : &n.left;
+        }
+        if (*slot == pool_t::null) return;
+        node& n = pool.get(*slot);
+        if (n.left != pool_t::null && n.right != pool_t::null) {
+            ref* next = &n.right;
+            while (pool.get(*next).left != pool_t::null) {
+                next = &pool.get(*next).left;
+            }
+            n.val = pool.get(*next).val;
+            slot = next;
+        }
+        ref r = *slot;
+        node& d = pool.get(r);
+        *slot = d.left != pool_t::null ? d.left : d.right;
+        pool.release(r);
+    }
+
+    /**
+     * Calls f(value) for every value in the tree, in increasing order. Uses
+     * an explicit stack, since the tree can be as deep as it has nodes.
+     */
+    template <class F>
+    void for_each(F f) const {
+        std::vector<ref> stack;
+        ref r = root;
+        while (r != pool_t::null || !stack.empty()) {
+            while (r != pool_t::null) {
+                stack.push_back(r);
+                r = pool.get(r).left;
+            }
+            r = stack.back();
+            stack.pop_back();
+            f(pool.get(r).val);
+            r = pool.get(r).right;
+        }
+    }
+
+    /**
+     * @return Bytes the tree takes (see include/mem_usage.hpp), with all
+     *         nodes of the allocator.
+     */
+    size_t bytes_used() const { return sizeof(*this) + pool.heap_bytes(); }
+
+    /**
+     * Batched count, see batch.hpp. Searching a tree is a chain of dependent
+     * loads, node after node, so a single search can never have more than
+     * one cache miss outstanding. Here 16 searches walk down the tree side by
+     * side, and every step prefetches the node that search will visit next.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        detail::interleave<16, ref>(
+            n,
+            [&](size_t i, ref& r) {
+                r = root;
+                out[i] = 0;
+            },
+            [&](size_t i, ref& r) {
+                if (r == pool_t::null) return true;
+                const node& nd = pool.get(r);
+                if (nd.val == vals[i]) [[unlikely]] {
+                    out[i] = 1;
+                    return true;
+                }
+                r = vals[i] > nd.val ? nd.right : nd.left;
+                if (r != pool_t::null) __builtin_prefetch(&pool.get(r));
+                return false;
+            });
     }
 };
 
@@ -172,14 +293,21 @@ class binary_tree {
  * Defined here in a private section of the binary_tree class to keep it
  * from being visible to code referencing the "binary_tree.hpp" header.
  *
+ * Children are referenced through the allocator's reference type, so every
+ * step down the tree goes through the pool that owns the nodes.
+ *
  * @tparam dtype Type of integers to store.
+ * @tparam alloc Node allocator template.
  */
-template <class dtype>
-class binary_tree<dtype>::node {
+template <class dtype, template <class> class alloc>
+class binary_tree<dtype, alloc>::node {
    private:
+    // The binary tree frees nodes and needs to see the links.
+    friend class binary_tree;
+
     dtype val;
-    node* left = nullptr;
-    node* right = nullptr;
+    ref left = pool_t::null;
+    ref right = pool_t::null;
 
    public:
     /**
@@ -208,22 +336,22 @@ class binary_tree<dtype>::node {
     node(node&&) = delete;
     node& operator=(node&&) = delete;
 
-    /**
-     * Again, manual destructor to guard against memory leaks.
+    /*
+     * No destructor here. Freeing the children is handled by the tree
+     * (binary_tree::free_subtree) since only the pool knows how a reference
+     * is turned back into memory. It also keeps the node trivially
+     * destructible, which the arena allocators require.
      */
-    ~node() {
-        if (left != nullptr) delete (left);
-        if (right != nullptr) delete (right);
-    }
 
     /**
      * Ensures that value is present in the subtree rooted at this node. If
      * the value already exists nothing is done (since this is logically a
      * set).
      *
+     * @param pool  Allocator owning the nodes of the tree.
      * @param value Value to insert.
      */
-    void insert(dtype value) {
+    void insert(pool_t& pool, dtype value) {
         /* For any given node, it is unlikely that (val == value), this we
          * mark this branch unlikely. Here flipping the statement would
          * again work but would be more unclear (IMO):
@@ -236,16 +364,16 @@ class binary_tree<dtype>::node {
             return;
         }
         if (value > val) {
-            if (right == nullptr) {
-                right = new node(value);
+            if (right == pool_t::null) {
+                right = pool.make(value);
             } else {
-                right->insert(value);
+                pool.get(right).insert(pool, value);
             }
         } else {
-            if (left == nullptr) {
-                left = new node(value);
+            if (left == pool_t::null) {
+                left = pool.make(value);
             } else {
-                left->insert(value);
+                pool.get(left).insert(pool, value);
             }
         }
     }
@@ -253,10 +381,11 @@ class binary_tree<dtype>::node {
     /**
      * Looks for value in the subtree rooted at this node.
      *
+     *  @param pool  Allocator owning the nodes of the tree.
      *  @param value Value to look for.
      *  @return true iff value is present in subtree.
      */
-    bool query(dtype value) const {
+    bool query(const pool_t& pool, dtype value) const {
         if (value == val) [[unlikely]] {
             return true;
         }
@@ -264,9 +393,11 @@ class binary_tree<dtype>::node {
         // optimize, especially in tail recursion situations like this. The
         // first (affirmative) branch should be the more likely one.
         if (value > val) {
-            return right != nullptr ? right->query(value) : false;
+            return right != pool_t::null ? pool.get(right).query(pool, value)
+                                         : false;
         }
-        return left != nullptr ? left->query(value) : false;
+        return left != pool_t::null ? pool.get(left).query(pool, value)
+                                    : false;
     }
 };
 
@@ -0,0 +1,368 @@
+/**
+ * B+-tree with cache line sized nodes.
+ *
+ * Binary trees (std::set, pfp::binary_tree, pfp::balanced_tree) take one
+ * cache miss for every level, and there are log2(n) levels. Here every node
+ * holds B keys, so the tree is only log_B(n) levels deep, and the keys of a
+ * node sit next to each other in one or two cache lines. Searching inside a
+ * node is done with SIMD compares: the position of x is simply the number of
+ * keys that are less than x, which AVX2 computes for 8 keys with a compare,
+ * a movemask and a popcount, without any branches.
+ *
+ * All values are stored in the leaves. Inner nodes store, for each child but
+ * the last, the largest key in that child's subtree. Unused key slots are
+ * filled with the largest possible dtype value so that they are never less
+ * than x, which means the whole node can always be compared at once.
+ *
+ * Erasing only removes the key from its leaf. Leaves are never merged and
+ * separators are left alone, they stay valid upper bounds. With erasures
+ * far less frequent than insertions and queries this costs some space but
+ * none of the speed of searches.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "mem_usage.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+/**
+ * Counts the keys in a[0, n) that are less than x. Generic version, which
+ * compilers will usually vectorize since it has no early exit.
+ */
+template <class dtype, unsigned n>
+inline uint32_t rank_lt(const dtype* a, dtype x) {
+    uint32_t r = 0;
+    for (unsigned i = 0; i < n; ++i) r += a[i] < x;
+    return r;
+}
+
+#if defined(__AVX2__)
+/**
+ * AVX2 version for 32-bit signed keys. a must be 32-byte aligned.
+ */
+template <unsigned n>
+inline uint32_t rank_lt_avx2(const int32_t* a, int32_t x) {
+    static_assert(n % 8 == 0, "whole vectors only");
+    __m256i xv = _mm256_set1_epi32(x);
+    uint32_t r = 0;
+    for (unsigned i = 0; i < n; i += 8) {
+        __m256i k =
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i lt = _mm256_cmpgt_epi32(xv, k);
+        r += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    return r;
+}
+#endif
+
+}  // namespace detail
+
+/**
+ * @tparam dtype Type of integer this tree stores.
+ * @tparam B     Keys per node. 32 int keys are two cache lines, which the
+ *               adjacent line prefetcher fetches together. Faster than both
+ *               16 and 64 on data.txt and sorted.txt.
+ */
+template <class dtype, unsigned B = 32>
+class btree {
+   private:
+    static_assert(B >= 8 && B % 8 == 0, "B must be a multiple of 8");
+    static constexpr dtype pad = std::numeric_limits<dtype>::max();
+    // A tree of height 32 with B >= 8 would hold more than 4^32 keys.
+    static constexpr int max_height = 32;
+
+    struct alignas(64) leaf {
+        dtype keys[B];
+        uint32_t n;
+    };
+
+    struct alignas(64) inner {
+        dtype keys[B];
+        uint32_t child[B + 1];
+        // Number of separator keys. The node has n + 1 children.
+        uint32_t n;
+    };
+
+    std::vector<leaf> leaves_;
+    std::vector<inner> inners_;
+    uint32_t root_ = 0;
+    // Number of inner levels. 0 means that the root is a leaf.
+    int height_ = 0;
+
+    static uint32_t rank(const dtype* keys, dtype x) {
+#if defined(__AVX2__)
+        if constexpr (std::is_same<dtype, int32_t>::value) {
+            return detail::rank_lt_avx2<B>(keys, x);
+        }
+#endif
+        return detail::rank_lt<dtype, B>(keys, x);
+    }
+
+    uint32_t new_leaf() {
+        leaves_.emplace_back();
+        leaf& l = leaves_.back();
+        for (unsigned i = 0; i < B; ++i) l.keys[i] = pad;
+        l.n = 0;
+        return leaves_.size() - 1;
+    }
+
+    uint32_t new_inner() {
+        inners_.emplace_back();
+        inner& in = inners_.back();
+        for (unsigned i = 0; i < B; ++i) in.keys[i] = pad;
+        in.n = 0;
+        return inners_.size() - 1;
+    }
+
+    /**
+     * Splits the full leaf l while inserting x at position r.
+     *
+     * @param sep Output for the largest key that stays in l.
+     * @return Index of the new right sibling.
+     */
+    uint32_t split_leaf(uint32_t l, uint32_t r, dtype x, dtype& sep) {
+        uint32_t right = new_leaf();
+        leaf& a = leaves_[l];
+        leaf& b = leaves_[right];
+        if (r == B) {
+            // Appending, as happens for every split with sorted input.
+            // Leave the old leaf full instead of half empty.
+            b.keys[0] = x;
+            b.n = 1;
+            sep = a.keys[B - 1];
+            return right;
+        }
+        constexpr uint32_t mid = B / 2;
+        for (uint32_t i = mid; i < B; ++i) {
+            b.keys[i - mid] = a.keys[i];
+            a.keys[i] = pad;
+        }
+        a.n = mid;
+        b.n = B - mid;
+        leaf& t = r < mid ? a : b;
+        uint32_t pos = r < mid ? r : r - mid;
+        for (uint32_t i = t.n; i > pos; --i) t.keys[i] = t.keys[i - 1];
+        t.keys[pos] = x;
+        ++t.n;
+        sep = a.keys[a.n - 1];
+        return right;
+    }
+
+    /**
+     * Inserts separator sep and the child to its right at position c of the
+     * inner node p, which must have room.
+     */
+    void insert_separator(inner& p, uint32_t c, dtype sep, uint32_t child) {
+        for (uint32_t i = p.n; i > c; --i) {
+            p.keys[i] = p.keys[i - 1];
+            p.child[i + 1] = p.child[i];
+        }
+        p.keys[c] = sep;
+        p.child[c + 1] = child;
+        ++p.n;
+    }
+
+    /**
+     * Splits the full inner node p while inserting sep and child at c.
+     *
+     * @param up Output for the separator that moves up to the parent.
+     * @return Index of the new right sibling.
+     */
+    uint32_t split_inner(uint32_t p, uint32_t c, dtype sep, uint32_t child,
+                         dtype& up) {
+        uint32_t right = new_inner();
+        inner& a = inners_[p];
+        inner& b = inners_[right];
+        dtype keys[B + 1];
+        uint32_t children[B + 2];
+        for (uint32_t i = 0, j = 0; i <= B; ++i) {
+            if (i == c) {
+                keys[i] = sep;
+            } else {
+                keys[i] = a.keys[j++];
+            }
+        }
+        for (uint32_t i = 0, j = 0; i <= B + 1; ++i) {
+            if (i == c + 1) {
+                children[i] = child;
+            } else {
+                children[i] = a.child[j++];
+            }
+        }
+        // Appending keeps the left node full, like for leaves.
+        uint32_t m = c == B ? B : (B + 1) / 2;
+        for (uint32_t i = 0; i < B; ++i) a.keys[i] = i < m ? keys[i] : pad;
+        for (uint32_t i = 0; i <= m; ++i) a.child[i] = children[i];
+        a.n = m;
+        up = keys[m];
+        b.n = B - m;
+        for (uint32_t i = 0; i < b.n; ++i) b.keys[i] = keys[m + 1 + i];
+        for (uint32_t i = 0; i <= b.n; ++i) b.child[i] = children[m + 1 + i];
+        return right;
+    }
+
+   public:
+    btree() { root_ = new_leaf(); }
+
+    btree(const btree&) = delete;
+    btree& operator=(const btree&) = delete;
+    btree(btree&&) = delete;
+    btree& operator=(btree&&) = delete;
+
+    /**
+     * Inserts value if it is not already present.
+     *
+     * @param value Element to be inserted.
+     */
+    void insert(dtype value) {
+        uint32_t path[max_height];
+        uint32_t pos[max_height];
+        uint32_t node = root_;
+        for (int h = 0; h < height_; ++h) {
+            const inner& in = inners_[node];
+            uint32_t c = rank(in.keys, value);
+            path[h] = node;
+            pos[h] = c;
+            node = in.child[c];
+        }
+        leaf& l = leaves_[node];
+        uint32_t r = rank(l.keys, value);
+        if (r < l.n && l.keys[r] == value) return;
+        if (l.n < B) [[likely]] {
+            for (uint32_t i = l.n; i > r; --i) l.keys[i] = l.keys[i - 1];
+            l.keys[r] = value;
+            ++l.n;
+            return;
+        }
+        dtype sep;
+        uint32_t right = split_leaf(node, r, value, sep);
+        // Push the split up the path until a node has room.
+        for (int h = height_ - 1; h >= 0; --h) {
+            inner& p = inners_[path[h]];
+            if (p.n < B) {
+                insert_separator(p, pos[h], sep, right);
+                return;
+            }
+            dtype up;
+            right = split_inner(path[h], pos[h], sep, right, up);
+            sep = up;
+        }
+        // The root was split.
+        uint32_t old_root = root_;
+        root_ = new_inner();
+        inner& in = inners_[root_];
+        in.keys[0] = sep;
+        in.child[0] = old_root;
+        in.child[1] = right;
+        in.n = 1;
+        ++height_;
+    }
+
+    /**
+     * Removes value if it is present. The leaf may become empty, see the
+     * top of the file.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        uint32_t node = root_;
+        for (int h = 0; h < height_; ++h) {
+            const inner& in = inners_[node];
+            node = in.child[rank(in.keys, value)];
+        }
+        leaf& l = leaves_[node];
+        uint32_t r = rank(l.keys, value);
+        if (r >= l.n || l.keys[r] != value) return;
+        --l.n;
+        for (uint32_t i = r; i < l.n; ++i) l.keys[i] = l.keys[i + 1];
+        l.keys[l.n] = pad;
+    }
+
+    /**
+     * Calls f(value) for every value in the tree, leaf by leaf in the order
+     * the leaves were created.
+     */
+    template <class F>
+    void for_each(F f) const {
+        for (const leaf& l : leaves_) {
+            for (uint32_t i = 0; i < l.n; ++i) f(l.keys[i]);
+        }
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the tree, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint32_t node = root_;
+        for (int h = 0; h < height_; ++h) {
+            const inner& in = inners_[node];
+            node = in.child[rank(in.keys, value)];
+        }
+        const leaf& l = leaves_[node];
+        uint32_t r = rank(l.keys, value);
+        return r < l.n && l.keys[r] == value;
+    }
+
+    /**
+     * @return Bytes the tree takes (see include/mem_usage.hpp), both node
+     *         arrays with their spare capacity.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + detail::heap_bytes(leaves_) +
+               detail::heap_bytes(inners_);
+    }
+
+    /**
+     * Batched count, see batch.hpp. Every search goes through exactly
+     * height_ inner nodes, so 16 searches can descend in lockstep, one level
+     * at a time, prefetching the keys of the nodes on the next level.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t lanes = 16;
+        uint32_t node[lanes];
+        for (size_t i = 0; i < n; i += lanes) {
+            size_t m = std::min(lanes, n - i);
+            const dtype* v = vals + i;
+            for (size_t j = 0; j < m; ++j) node[j] = root_;
+            for (int h = 0; h < height_; ++h) {
+                bool last = h + 1 == height_;
+                for (size_t j = 0; j < m; ++j) {
+                    const inner& in = inners_[node[j]];
+                    node[j] = in.child[rank(in.keys, v[j])];
+                    const char* next =
+                        last ? reinterpret_cast<const char*>(&leaves_[node[j]])
+                             : reinterpret_cast<const char*>(&inners_[node[j]]);
+                    for (size_t b = 0; b < sizeof(dtype) * B; b += 64) {
+                        __builtin_prefetch(next + b);
+                    }
+                }
+            }
+            for (size_t j = 0; j < m; ++j) {
+                const leaf& l = leaves_[node[j]];
+                uint32_t r = rank(l.keys, v[j]);
+                out[i + j] = r < l.n && l.keys[r] == v[j];
+            }
+        }
+    }
+};
+
+}  // namespace pfp
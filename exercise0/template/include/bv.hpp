@@ -1,21 +1,387 @@
 /**
- * You can use this for programming task 2 of set 1 
-*/
+ * Bit vector set.
+ *
+ * One bit per possible value, packed into 64-bit words. Insert, erase and
+ * count are a shift, a mask and a single memory access with no branches. The
+ * price is memory proportional to the limit, not to the number of stored
+ * values. Union, intersection and difference with another bit vector are a
+ * single OR, AND or AND NOT per word, in loops the compiler vectorizes.
+ *
+ * Once all values are in, build_rank() adds a small index for rank (how many
+ * values are smaller than x) and select (the k-th smallest value), the
+ * location queries of exercise2. The index counts the set bits at two
+ * levels:
+ *
+ * - For every superblock of 4096 bits, the number of set bits before it, as
+ *   a uint64_t.
+ * - For every block of 512 bits (one cache line of the bit vector), the
+ *   number of set bits before it within its superblock, as a uint16_t.
+ *
+ * Together that is 0.6% of the size of the bit vector. rank(x) adds the two
+ * counts for x and the popcounts of at most 8 words of one cache line, so it
+ * takes constant time. select(k) additionally keeps the superblock of every
+ * 8192nd value, binary searches between two of those samples, scans the 8
+ * block counts of a superblock and finds the bit within the word with pdep
+ * (BMI2), where available.
+ */
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+#include "mem_usage.hpp"
+#include "page_alloc.hpp"
+#include "parallel.hpp"
+#include "snapshot.hpp"
+
 namespace pfp {
 
+/**
+ * @tparam dtype Type of integer this set stores.
+ */
 template <class dtype>
 class bv {
-  public:
-    bv(dtype limit) {}
+   private:
+    // Bit vectors up to this size are faulted in when created. Larger ones
+    // (like the 256 MiB needed for the default limit) are zeroed lazily by
+    // the kernel as pages are first touched.
+    static constexpr size_t populate_bytes = size_t(32) << 20;
+    // Words per block and per superblock of the rank index.
+    static constexpr size_t block_words = 8;
+    static constexpr size_t super_words = 64;
+    static constexpr size_t blocks_per_super = super_words / block_words;
+    // Every select_sample'th value is sampled for select.
+    static constexpr uint64_t select_sample = 8192;
+
+    uint64_t* words_;
+    size_t bytes_;
+    // True iff words_ points into a loaded snapshot instead of page_alloc
+    // memory.
+    bool mapped_ = false;
+    // The rank index, see the top of the file. super_ and samples_ have one
+    // extra entry at the end, the total and the last superblock.
+    std::vector<uint64_t> super_;
+    std::vector<uint16_t> blocks_;
+    std::vector<uint32_t> samples_;
+
+    size_t words() const { return bytes_ / sizeof(uint64_t); }
 
-    void insert(dtype value) { }
+    /**
+     * Sets every word to f(word, word of other), a page of words at a time.
+     * Pages that f would leave unchanged are skipped (where the words of
+     * other are 0, or for intersections the own words), so that the pages
+     * of a large bit vector that were never touched stay unmapped.
+     *
+     * @param own_zero True iff f(0, x) = 0, false iff f(x, 0) = x.
+     */
+    template <class F>
+    void combine(const bv& other, bool own_zero, F f) {
+        constexpr size_t page_words = 4096 / sizeof(uint64_t);
+        uint64_t* __restrict a = words_;
+        const uint64_t* __restrict b = other.words_;
+        const uint64_t* skip = own_zero ? a : b;
+        size_t n = std::min(words(), other.words());
+        for (size_t p = 0; p < n; p += page_words) {
+            size_t end = std::min(n, p + page_words);
+            uint64_t any = 0;
+            for (size_t i = p; i < end; ++i) any |= skip[i];
+            if (any == 0) continue;
+            for (size_t i = p; i < end; ++i) a[i] = f(a[i], b[i]);
+        }
+    }
+
+    /**
+     * Position of the set bit of w with r set bits before it.
+     */
+    static unsigned select_in_word(uint64_t w, unsigned r) {
+#if defined(__BMI2__)
+        // pdep moves the bit 1 << r to the position of the r-th set bit.
+        return __builtin_ctzll(_pdep_u64(uint64_t(1) << r, w));
+#else
+        for (unsigned i = 0; i < r; ++i) w &= w - 1;
+        return __builtin_ctzll(w);
+#endif
+    }
+
+   public:
+    /**
+     * @param limit Highest value that will be inserted or queried.
+     */
+    bv(dtype limit)
+        : bytes_((uint64_t(limit) / 64 + 1) * sizeof(uint64_t)) {
+        words_ = static_cast<uint64_t*>(
+            page_alloc(bytes_, bytes_ <= populate_bytes));
+    }
+
+    ~bv() {
+        if (!mapped_) page_free(words_, bytes_);
+    }
+
+    bv(const bv&) = delete;
+    bv& operator=(const bv&) = delete;
+    bv(bv&&) = delete;
+    bv& operator=(bv&&) = delete;
+
+    /**
+     * Inserts all of [begin, end), using the threads of pool.
+     *
+     * Threads cannot simply take a slice of the input each, since two of
+     * them could set bits in the same word at the same time. Instead the
+     * words are divided into ranges, and the values are first partitioned
+     * by range (with a counting pass and a scatter pass over the input, one
+     * input slice per thread). Then every range is filled in by one thread.
+     * All passes are independent per thread, so the build scales until it
+     * runs out of memory bandwidth. Input that only touches a few ranges
+     * gets less parallelism in the last pass.
+     *
+     * @param pool Threads to use, or nullptr.
+     */
+    void build_from(const dtype* begin, const dtype* end, thread_pool* pool) {
+        constexpr size_t parallel_min = size_t(1) << 16;
+        size_t n = end - begin;
+        size_t t = pool == nullptr ? 1 : pool->size();
+        if (t == 1 || n < parallel_min) {
+            for (const dtype* p = begin; p < end; ++p) insert(*p);
+            return;
+        }
+        // Ranges of 2^shift words, about 4 per thread so that threads that
+        // finish early can pick up more.
+        size_t words = bytes_ / sizeof(uint64_t);
+        unsigned shift = 3;
+        while (((words - 1) >> shift) + 1 > 4 * t) ++shift;
+        size_t ranges = ((words - 1) >> shift) + 1;
+        unsigned value_shift = shift + 6;
+        auto slice = [&](size_t k) { return begin + n * k / t; };
+
+        std::vector<size_t> offsets(t * ranges);
+        pool->run(t, [&](size_t k) {
+            size_t* c = &offsets[k * ranges];
+            for (const dtype* p = slice(k); p < slice(k + 1); ++p) {
+                ++c[uint64_t(*p) >> value_shift];
+            }
+        });
+        // Values are grouped by range, and by input slice within a range.
+        std::vector<size_t> range_start(ranges + 1);
+        size_t sum = 0;
+        for (size_t r = 0; r < ranges; ++r) {
+            range_start[r] = sum;
+            for (size_t k = 0; k < t; ++k) {
+                size_t c = offsets[k * ranges + r];
+                offsets[k * ranges + r] = sum;
+                sum += c;
+            }
+        }
+        range_start[ranges] = sum;
+        std::unique_ptr<dtype[]> grouped(new dtype[n]);
+        pool->run(t, [&](size_t k) {
+            size_t* o = &offsets[k * ranges];
+            for (const dtype* p = slice(k); p < slice(k + 1); ++p) {
+                grouped[o[uint64_t(*p) >> value_shift]++] = *p;
+            }
+        });
+        pool->run(ranges, [&](size_t r) {
+            for (size_t i = range_start[r]; i < range_start[r + 1]; ++i) {
+                insert(grouped[i]);
+            }
+        });
+    }
+
+    /**
+     * Sets the bit for value.
+     *
+     * @param value Element to be inserted, at most the limit.
+     */
+    void insert(dtype value) {
+        uint64_t v = value;
+        words_[v / 64] |= uint64_t(1) << (v % 64);
+    }
+
+    /**
+     * Clears the bit for value.
+     *
+     * @param value Element to be removed, at most the limit.
+     */
+    void erase(dtype value) {
+        uint64_t v = value;
+        words_[v / 64] &= ~(uint64_t(1) << (v % 64));
+    }
 
+    /**
+     * @param value The value to count the occurrences of, at most the limit.
+     * @return 1 if value is in the set, otherwise 0.
+     */
     int count(dtype value) const {
-        return 0;
+        uint64_t v = value;
+        return (words_[v / 64] >> (v % 64)) & 1;
+    }
+
+    /**
+     * Adds the values of other, a bit vector with the same limit. See
+     * include/set_ops.hpp.
+     */
+    void unite(const bv& other) {
+        combine(other, false, [](uint64_t a, uint64_t b) { return a | b; });
+    }
+
+    /**
+     * Keeps only the values that are also in other, a bit vector with the
+     * same limit.
+     */
+    void intersect(const bv& other) {
+        combine(other, true, [](uint64_t a, uint64_t b) { return a & b; });
+    }
+
+    /**
+     * Removes the values of other, a bit vector with the same limit.
+     */
+    void subtract(const bv& other) {
+        combine(other, false, [](uint64_t a, uint64_t b) { return a & ~b; });
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp): all words up
+     *         to the limit, touched or not, and the rank index.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + bytes_ + detail::heap_bytes(super_) +
+               detail::heap_bytes(blocks_) + detail::heap_bytes(samples_);
+    }
+
+    /**
+     * Batched count, see batch.hpp. Prefetches the words of the queries a
+     * few positions ahead, which matters once the bit vector is larger than
+     * the caches.
+     *
+     * @param vals Values to look up, at most the limit.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 16;
+        size_t i = 0;
+        for (; i + ahead < n; ++i) {
+            __builtin_prefetch(words_ + uint64_t(vals[i + ahead]) / 64);
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+
+    /**
+     * Stores the words as the only section of a snapshot (see
+     * include/snapshot.hpp).
+     */
+    void save(snapshot_writer& w) const {
+        w.section();
+        w.append(words_, bytes_);
+    }
+
+    /**
+     * Uses the words of a snapshot in place, instead of its own.
+     *
+     * @return false iff the snapshot is for a different limit.
+     */
+    bool load(snapshot& s) {
+        size_t bytes = 0;
+        void* p = s.section(0, bytes);
+        if (p == nullptr || bytes != bytes_) return false;
+        if (!mapped_) page_free(words_, bytes_);
+        words_ = static_cast<uint64_t*>(p);
+        mapped_ = true;
+        return true;
+    }
+
+    /**
+     * Builds the index for rank and select. Needs to be called again after
+     * further changes.
+     */
+    void build_rank() {
+        size_t n = words();
+        size_t supers = (n + super_words - 1) / super_words;
+        super_.assign(supers + 1, 0);
+        blocks_.assign(supers * blocks_per_super, 0);
+        samples_.clear();
+        uint64_t total = 0;
+        for (size_t s = 0; s < supers; ++s) {
+            super_[s] = total;
+            uint64_t in_super = 0;
+            for (size_t b = 0; b < blocks_per_super; ++b) {
+                blocks_[s * blocks_per_super + b] = uint16_t(in_super);
+                size_t w = (s * blocks_per_super + b) * block_words;
+                size_t end = std::min(n, w + block_words);
+                for (; w < end; ++w) {
+                    in_super += __builtin_popcountll(words_[w]);
+                }
+            }
+            // Superblocks that contain a sampled value.
+            while (uint64_t(samples_.size()) * select_sample <
+                   total + in_super) {
+                samples_.push_back(uint32_t(s));
+            }
+            total += in_super;
+        }
+        super_[supers] = total;
+        samples_.push_back(uint32_t(supers > 0 ? supers - 1 : 0));
+    }
+
+    /**
+     * Number of values in the set. Needs build_rank().
+     */
+    uint64_t size() const { return super_.back(); }
+
+    /**
+     * Number of values in the set that are smaller than x. Needs
+     * build_rank().
+     *
+     * @param x Any value, also larger than the limit.
+     */
+    uint64_t rank(uint64_t x) const {
+        size_t w = x / 64;
+        if (w >= words()) return size();
+        size_t b = w / block_words;
+        uint64_t r = super_[w / super_words] + blocks_[b];
+        for (size_t i = b * block_words; i < w; ++i) {
+            r += __builtin_popcountll(words_[i]);
+        }
+        uint64_t below = (uint64_t(1) << (x % 64)) - 1;
+        return r + __builtin_popcountll(words_[w] & below);
+    }
+
+    /**
+     * The value with k smaller values in the set, i.e. the (k + 1)-th
+     * smallest. Needs build_rank().
+     *
+     * @param k Less than size().
+     */
+    uint64_t select(uint64_t k) const {
+        // The superblock holding the value is between the superblocks of
+        // the samples around it.
+        size_t j = k / select_sample;
+        auto first = super_.begin() + samples_[j];
+        auto last = super_.begin() + samples_[j + 1] + 1;
+        size_t s = std::upper_bound(first, last, k) - super_.begin() - 1;
+        uint64_t r = k - super_[s];
+        size_t b = s * blocks_per_super;
+        for (size_t i = 1; i < blocks_per_super; ++i) {
+            b += blocks_[s * blocks_per_super + i] <= r;
+        }
+        r -= blocks_[b];
+        size_t w = b * block_words;
+        while (true) {
+            unsigned c = __builtin_popcountll(words_[w]);
+            if (r < c) break;
+            r -= c;
+            ++w;
+        }
+        return w * 64 + select_in_word(words_[w], unsigned(r));
     }
 };
 
-} // namespace pfp
\ No newline at end of file
+}  // namespace pfp
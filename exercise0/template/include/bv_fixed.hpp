@@ -0,0 +1,126 @@
+/**
+ * Bit vector set with the limit fixed at compile time.
+ *
+ * pfp::bv allocates its words at runtime, so every access goes through the
+ * pointer to them. When the limit is a template parameter the words can be a
+ * static array instead: its address is a link time constant that the
+ * compiler folds into the instructions, and since the array lives in the
+ * zero filled .bss section, the first set of a run needs no allocation or
+ * mmap at all. query.cpp uses it for the bit vector (type 5) when the limit
+ * is at most one of a few common sizes, see fixed_bv_types there.
+ *
+ * The static array is shared by all objects of one instantiation, so only
+ * one of them can exist at a time. A new object clears the array left
+ * behind by the previous one.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integer this set stores.
+ * @tparam Limit Highest value that will be inserted or queried.
+ */
+template <class dtype, uint64_t Limit>
+class bv_fixed {
+   private:
+    static constexpr size_t n_words = Limit / 64 + 1;
+
+    alignas(64) static inline uint64_t words_[n_words];
+    // Whether an object exists, and whether the words were ever written.
+    static inline bool live_ = false;
+    static inline bool dirty_ = false;
+
+   public:
+    static constexpr uint64_t limit = Limit;
+
+    bv_fixed() {
+        assert(!live_);
+        live_ = true;
+        if (dirty_) std::memset(words_, 0, sizeof(words_));
+        dirty_ = true;
+    }
+
+    ~bv_fixed() { live_ = false; }
+
+    bv_fixed(const bv_fixed&) = delete;
+    bv_fixed& operator=(const bv_fixed&) = delete;
+    bv_fixed(bv_fixed&&) = delete;
+    bv_fixed& operator=(bv_fixed&&) = delete;
+
+    /**
+     * Sets the bit for value.
+     *
+     * @param value Element to be inserted, at most Limit.
+     */
+    void insert(dtype value) {
+        uint64_t v = value;
+        words_[v / 64] |= uint64_t(1) << (v % 64);
+    }
+
+    /**
+     * Clears the bit for value.
+     *
+     * @param value Element to be removed, at most Limit.
+     */
+    void erase(dtype value) {
+        uint64_t v = value;
+        words_[v / 64] &= ~(uint64_t(1) << (v % 64));
+    }
+
+    /**
+     * @param value The value to count the occurrences of, at most Limit.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint64_t v = value;
+        return (words_[v / 64] >> (v % 64)) & 1;
+    }
+
+    /**
+     * Calls f(value) for every value in the set, in increasing order. Bit
+     * vectors of other types are combined word by word (see
+     * include/set_ops.hpp), but with the words in a static array no second
+     * one can exist next to this one.
+     */
+    template <class F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < n_words; ++i) {
+            for (uint64_t w = words_[i]; w != 0; w &= w - 1) {
+                f(dtype(i * 64 + __builtin_ctzll(w)));
+            }
+        }
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp), which are
+     *         the static words.
+     */
+    size_t bytes_used() const { return sizeof(*this) + sizeof(words_); }
+
+    /**
+     * Batched count, see batch.hpp. Like pfp::bv, prefetches the words of
+     * the queries a few positions ahead.
+     *
+     * @param vals Values to look up, at most Limit.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 16;
+        size_t i = 0;
+        for (; i + ahead < n; ++i) {
+            __builtin_prefetch(words_ + uint64_t(vals[i + ahead]) / 64);
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,108 @@
+/**
+ * Bounded blocking queue between threads.
+ *
+ * Used wherever one thread produces blocks of work for another: the verifier
+ * of include/verify.hpp, the reader thread of include/pipeline.hpp and the
+ * output thread of include/writer.hpp. Blocks are passed as
+ * std::unique_ptr, so that they can be handed back and reused instead of
+ * being allocated again.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace pfp {
+
+/**
+ * Bounded blocking queue that hands objects from one thread to another.
+ *
+ * @tparam T Type of the objects, passed around as std::unique_ptr<T>.
+ */
+template <class T>
+class channel {
+   private:
+    std::deque<std::unique_ptr<T>> items_;
+    size_t capacity_;
+    bool closed_ = false;
+    std::mutex m_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+
+   public:
+    /**
+     * @param capacity Objects that may wait in the queue at once.
+     */
+    explicit channel(size_t capacity) : capacity_(capacity) {}
+
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+    channel(channel&&) = delete;
+    channel& operator=(channel&&) = delete;
+
+    /**
+     * Appends item, waiting while the queue is full.
+     *
+     * @return false iff the channel was closed. The item is dropped then.
+     */
+    bool push(std::unique_ptr<T> item) {
+        std::unique_lock<std::mutex> lock(m_);
+        space_.wait(lock,
+                    [&]() { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        ready_.notify_one();
+        return true;
+    }
+
+    /**
+     * Takes the oldest item, waiting while the queue is empty.
+     *
+     * @return nullptr once the channel is closed and empty.
+     */
+    std::unique_ptr<T> pop() {
+        std::unique_lock<std::mutex> lock(m_);
+        ready_.wait(lock, [&]() { return closed_ || !items_.empty(); });
+        if (items_.empty()) return nullptr;
+        std::unique_ptr<T> item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        space_.notify_one();
+        return item;
+    }
+
+    /**
+     * Takes the oldest item without waiting.
+     *
+     * @return nullptr if the queue is empty.
+     */
+    std::unique_ptr<T> try_pop() {
+        std::unique_lock<std::mutex> lock(m_);
+        if (items_.empty()) return nullptr;
+        std::unique_ptr<T> item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        space_.notify_one();
+        return item;
+    }
+
+    /**
+     * Wakes up all waiting threads. Items already in the queue can still be
+     * taken, further pushes fail.
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+        space_.notify_all();
+    }
+};
+
+}  // namespace pfp
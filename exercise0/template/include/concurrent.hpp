@@ -0,0 +1,297 @@
+/**
+ * Thread safe sets for several producers inserting and querying at once.
+ *
+ * Both sets have the interface of pfp::bv (insert, erase and count), and
+ * both may be called from any number of threads at the same time. Every
+ * operation is atomic: a query that runs concurrently with an insertion of
+ * the same value either sees it or not, and sees it in all later queries
+ * once it has.
+ *
+ * concurrent_bv    Bit vector with atomic fetch_or insertions. Lock free,
+ *                  each operation is still a single memory access. Memory
+ *                  proportional to the limit, like pfp::bv.
+ * concurrent_hash  Striped hash set for when there is no useful limit. The
+ *                  values are split into 64 shards by hash, and each shard is
+ *                  an open addressing table behind its own small spin lock.
+ *                  Producers only contend when they hit the same shard, one
+ *                  time in 64 for random values.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <type_traits>
+
+#include "page_alloc.hpp"
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integer this set stores.
+ */
+template <class dtype>
+class concurrent_bv {
+   private:
+    static constexpr size_t populate_bytes = size_t(32) << 20;
+
+    uint64_t* words_;
+    size_t bytes_;
+
+   public:
+    /**
+     * @param limit Highest value that will be inserted or queried.
+     */
+    concurrent_bv(dtype limit)
+        : bytes_((uint64_t(limit) / 64 + 1) * sizeof(uint64_t)) {
+        words_ = static_cast<uint64_t*>(
+            page_alloc(bytes_, bytes_ <= populate_bytes));
+    }
+
+    ~concurrent_bv() { page_free(words_, bytes_); }
+
+    concurrent_bv(const concurrent_bv&) = delete;
+    concurrent_bv& operator=(const concurrent_bv&) = delete;
+    concurrent_bv(concurrent_bv&&) = delete;
+    concurrent_bv& operator=(concurrent_bv&&) = delete;
+
+    /**
+     * Sets the bit for value. Another thread setting a different bit of the
+     * same word cannot be lost, since the read-modify-write is atomic. No
+     * ordering with other memory is needed, so the operation is relaxed.
+     *
+     * @param value Element to be inserted, at most the limit.
+     */
+    void insert(dtype value) {
+        uint64_t v = value;
+        uint64_t bit = uint64_t(1) << (v % 64);
+        // Skipping the locked instruction for bits that are already set
+        // keeps cache lines shared between readers.
+        if (__atomic_load_n(words_ + v / 64, __ATOMIC_RELAXED) & bit) return;
+        __atomic_fetch_or(words_ + v / 64, bit, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Clears the bit for value, atomically like insert.
+     *
+     * @param value Element to be removed, at most the limit.
+     */
+    void erase(dtype value) {
+        uint64_t v = value;
+        uint64_t bit = uint64_t(1) << (v % 64);
+        if (!(__atomic_load_n(words_ + v / 64, __ATOMIC_RELAXED) & bit)) return;
+        __atomic_fetch_and(words_ + v / 64, ~bit, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @param value The value to count the occurrences of, at most the limit.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint64_t v = value;
+        return (__atomic_load_n(words_ + v / 64, __ATOMIC_RELAXED) >>
+                (v % 64)) &
+               1;
+    }
+
+    /**
+     * @return Bytes the set takes, see include/mem_usage.hpp.
+     */
+    size_t bytes_used() const { return sizeof(*this) + bytes_; }
+};
+
+/**
+ * @tparam dtype Type of integer this set stores. Values must be
+ *               non-negative and less than the maximum of dtype.
+ */
+template <class dtype>
+class concurrent_hash {
+   private:
+    using key_t = std::make_unsigned_t<dtype>;
+    static constexpr unsigned shard_bits = 6;
+    static constexpr unsigned shards = 1u << shard_bits;
+    static constexpr size_t initial_slots = 1024;
+
+    /**
+     * Slots store value + 1, so that zeroed memory is an empty table.
+     * Aligned so that the locks of different shards never share a cache
+     * line.
+     */
+    struct alignas(64) shard {
+        mutable std::atomic<bool> locked{false};
+        key_t* slots = nullptr;
+        size_t mask = 0;
+        size_t size = 0;
+    };
+
+    shard shards_[shards];
+
+    static uint64_t hash(key_t k) {
+        // Murmur3 finalizer.
+        uint64_t h = k;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static key_t* new_slots(size_t n) {
+        void* p = std::calloc(n, sizeof(key_t));
+        if (p == nullptr) throw std::bad_alloc();
+        return static_cast<key_t*>(p);
+    }
+
+    static void lock(const shard& s) {
+        unsigned spins = 0;
+        while (s.locked.exchange(true, std::memory_order_acquire)) {
+            // Wait until the lock looks free before trying again, and give
+            // the core away if the holder seems to be descheduled.
+            while (s.locked.load(std::memory_order_relaxed)) {
+                if (++spins < 64) {
+                    __builtin_ia32_pause();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    static void unlock(const shard& s) {
+        s.locked.store(false, std::memory_order_release);
+    }
+
+    /**
+     * Doubles the table of s. The shard must be locked.
+     */
+    static void grow(shard& s) {
+        size_t n = (s.mask + 1) * 2;
+        key_t* slots = new_slots(n);
+        for (size_t i = 0; i <= s.mask; ++i) {
+            key_t k = s.slots[i];
+            if (k == 0) continue;
+            size_t j = (hash(k) >> shard_bits) & (n - 1);
+            while (slots[j] != 0) j = (j + 1) & (n - 1);
+            slots[j] = k;
+        }
+        std::free(s.slots);
+        s.slots = slots;
+        s.mask = n - 1;
+    }
+
+   public:
+    /**
+     * The limit is not needed, but accepted for the same interface as
+     * concurrent_bv.
+     */
+    concurrent_hash(dtype = 0) {
+        for (shard& s : shards_) {
+            s.slots = new_slots(initial_slots);
+            s.mask = initial_slots - 1;
+        }
+    }
+
+    ~concurrent_hash() {
+        for (shard& s : shards_) std::free(s.slots);
+    }
+
+    concurrent_hash(const concurrent_hash&) = delete;
+    concurrent_hash& operator=(const concurrent_hash&) = delete;
+    concurrent_hash(concurrent_hash&&) = delete;
+    concurrent_hash& operator=(concurrent_hash&&) = delete;
+
+    /**
+     * Inserts value. Duplicates are ignored.
+     *
+     * @param value Element to be inserted.
+     */
+    void insert(dtype value) {
+        key_t k = key_t(value) + 1;
+        uint64_t h = hash(k);
+        shard& s = shards_[h & (shards - 1)];
+        lock(s);
+        size_t i = (h >> shard_bits) & s.mask;
+        while (s.slots[i] != 0) {
+            if (s.slots[i] == k) {
+                unlock(s);
+                return;
+            }
+            i = (i + 1) & s.mask;
+        }
+        s.slots[i] = k;
+        // Keep the load factor at most 1/2, so probe sequences stay short.
+        if (++s.size * 2 > s.mask + 1) [[unlikely]] {
+            grow(s);
+        }
+        unlock(s);
+    }
+
+    /**
+     * Removes value, if it is in the set. Later keys of the same probe
+     * sequence move up into the hole (backward shift deletion), so lookups
+     * still stop at the first empty slot.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        key_t k = key_t(value) + 1;
+        uint64_t h = hash(k);
+        shard& s = shards_[h & (shards - 1)];
+        lock(s);
+        size_t i = (h >> shard_bits) & s.mask;
+        while (s.slots[i] != 0 && s.slots[i] != k) i = (i + 1) & s.mask;
+        if (s.slots[i] == k) {
+            for (size_t j = (i + 1) & s.mask; s.slots[j] != 0;
+                 j = (j + 1) & s.mask) {
+                // Key j may move to i iff its home is not in (i, j].
+                size_t home = (hash(s.slots[j]) >> shard_bits) & s.mask;
+                if (((j - home) & s.mask) >= ((j - i) & s.mask)) {
+                    s.slots[i] = s.slots[j];
+                    i = j;
+                }
+            }
+            s.slots[i] = 0;
+            --s.size;
+        }
+        unlock(s);
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        key_t k = key_t(value) + 1;
+        uint64_t h = hash(k);
+        const shard& s = shards_[h & (shards - 1)];
+        lock(s);
+        size_t i = (h >> shard_bits) & s.mask;
+        int found = 0;
+        while (s.slots[i] != 0) {
+            if (s.slots[i] == k) {
+                found = 1;
+                break;
+            }
+            i = (i + 1) & s.mask;
+        }
+        unlock(s);
+        return found;
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp), the tables
+     *         of all shards. Only while no other thread uses the set.
+     */
+    size_t bytes_used() const {
+        size_t bytes = sizeof(*this);
+        for (const shard& s : shards_) bytes += (s.mask + 1) * sizeof(key_t);
+        return bytes;
+    }
+};
+
+}  // namespace pfp
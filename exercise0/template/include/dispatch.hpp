@@ -0,0 +1,105 @@
+/**
+ * Compile-time lists of data structure types.
+ *
+ * query.cpp runs the same code with every data structure, each compiled
+ * separately for speed. Instead of spelling out one branch per type (and one
+ * per combination of flags) wherever a type is chosen, the types are listed
+ * once as a tuple of set_type entries:
+ *
+ *     const auto types = std::make_tuple(
+ *         pfp::set_type<std::set<int>>{1, "std::set"},
+ *         pfp::set_type<pfp::bv<int>, true>{5, "bit vector"});
+ *
+ * pfp::dispatch(types, id, f) then calls f with the entry of the given id, and
+ * f can get at the type with decltype. Adding a data structure is one line.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace pfp {
+
+/**
+ * One selectable data structure.
+ *
+ * @tparam set_t   The data structure.
+ * @tparam limited True iff the constructor takes the limit, like pfp::bv.
+ */
+template <class set_t, bool limited = false>
+struct set_type {
+    using type = set_t;
+    static constexpr bool takes_limit = limited;
+    // Number selecting the type with -t.
+    int id;
+    // Printed name.
+    const char* name;
+};
+
+/**
+ * Calls f(entry) for every entry of a type list, in order.
+ */
+template <class types, class F>
+void for_each_type(const types& list, F&& f) {
+    std::apply([&](const auto&... entry) { (f(entry), ...); }, list);
+}
+
+/**
+ * Calls f(entry) for the entry with the given id.
+ *
+ * @return false iff there is no such entry.
+ */
+template <class types, class F>
+bool dispatch(const types& list, int id, F&& f) {
+    bool found = false;
+    for_each_type(list, [&](const auto& entry) {
+        if (!found && entry.id == id) {
+            found = true;
+            f(entry);
+        }
+    });
+    return found;
+}
+
+/**
+ * Calls f(entry) for the first entry whose type has a compile time limit
+ * (a static member "limit", like pfp::bv_fixed) of at least limit. List the
+ * entries from the smallest limit to the largest.
+ *
+ * @return false iff no entry is large enough.
+ */
+template <class types, class F>
+bool dispatch_limit(const types& list, uint64_t limit, F&& f) {
+    bool found = false;
+    for_each_type(list, [&](const auto& entry) {
+        using set_t = typename std::decay_t<decltype(entry)>::type;
+        if (!found && limit <= set_t::limit) {
+            found = true;
+            f(entry);
+        }
+    });
+    return found;
+}
+
+/**
+ * Constructs the data structure of entry in place (the structures can not be
+ * moved) and calls f with it.
+ *
+ * @param limit Highest value, passed to the constructor if it takes it.
+ */
+template <class entry, class F>
+void with_set(const entry&, uint64_t limit, F&& f) {
+    using set_t = typename entry::type;
+    if constexpr (entry::takes_limit) {
+        set_t qs(limit);
+        f(qs);
+    } else {
+        set_t qs;
+        f(qs);
+    }
+}
+
+}  // namespace pfp
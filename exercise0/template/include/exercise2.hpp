@@ -0,0 +1,180 @@
+/**
+ * Input of the exercise2 problems, as written by exercise2/nums.py.
+ *
+ * The files are raw little endian uint64_t words:
+ *
+ * word 0          n       Number of values.
+ * word 1          limit   Values are smaller than this. For index queries
+ *                         (-c) the number of bits needed per value instead.
+ * words 2..2+n            The values.
+ * after that              The queries, as many as fill the rest of the file.
+ *
+ * What the queries mean depends on the flag nums.py was run with:
+ *
+ * -a  Membership / sum queries. A query q in [0, limit) asks whether q is
+ *     one of the values, and for the sum of all values that are at most q
+ *     (with repeated values counted every time).
+ * -b  Location queries. A query k in [1, d], with d the number of distinct
+ *     values, asks for the k-th smallest distinct value.
+ * -c  Index queries. A query i in [0, n) asks for the i-th value, in input
+ *     order. The values are stored in as many bits as word 1 says.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "mem_usage.hpp"
+
+namespace pfp {
+
+/**
+ * A memory mapped (or, for standard input, fully read) exercise2 file.
+ */
+class ex2_input {
+   private:
+    mapped_file map_;
+    std::vector<uint64_t> buf_;
+    const uint64_t* words_ = nullptr;
+    size_t size_ = 0;
+    bool ok_ = false;
+
+    void init(const char* data, size_t bytes) {
+        if (bytes % 8 != 0 || bytes < 16) return;
+        words_ = reinterpret_cast<const uint64_t*>(data);
+        size_ = bytes / 8;
+        ok_ = words_[0] <= size_ - 2;
+    }
+
+    void load(int fd) {
+        size_t size = 0;
+        buf_.resize(size_t(1) << 17);
+        while (true) {
+            if (size == buf_.size() * 8) buf_.resize(buf_.size() * 2);
+            ssize_t n = read(fd, reinterpret_cast<char*>(buf_.data()) + size,
+                             buf_.size() * 8 - size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size += n;
+        }
+        init(reinterpret_cast<const char*>(buf_.data()), size);
+    }
+
+   public:
+    /**
+     * Reads the whole file from a file descriptor, e.g. standard input.
+     *
+     * @param fd File descriptor to read from. Not closed.
+     */
+    explicit ex2_input(int fd) { load(fd); }
+
+    /**
+     * Maps the file at path, or reads it if it can not be mapped.
+     */
+    explicit ex2_input(const char* path) : map_(path) {
+        if (map_.ok()) {
+            init(map_.data(), map_.size());
+        } else {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) return;
+            load(fd);
+            close(fd);
+        }
+    }
+
+    ex2_input(const ex2_input&) = delete;
+    ex2_input& operator=(const ex2_input&) = delete;
+    ex2_input(ex2_input&&) = delete;
+    ex2_input& operator=(ex2_input&&) = delete;
+
+    /**
+     * @return false iff the input could not be read or is too short for
+     *         the number of values in its header.
+     */
+    bool ok() const { return ok_; }
+
+    /**
+     * Number of values.
+     */
+    size_t n() const { return words_[0]; }
+
+    /**
+     * Word 1 of the header, the limit or the number of bits per value.
+     */
+    uint64_t limit() const { return words_[1]; }
+
+    const uint64_t* values() const { return words_ + 2; }
+
+    size_t n_queries() const { return size_ - 2 - n(); }
+
+    const uint64_t* queries() const { return words_ + 2 + n(); }
+};
+
+/**
+ * Array of n values of a fixed number of bits each, packed back to back
+ * into 64-bit words. For the index queries of exercise2, where 20 bit values
+ * would otherwise take 64 bits each.
+ */
+class packed_array {
+   private:
+    std::vector<uint64_t> words_;
+    unsigned bits_;
+    uint64_t mask_;
+
+   public:
+    /**
+     * @param n    Number of values.
+     * @param bits Bits per value, 1 to 64.
+     */
+    packed_array(size_t n, unsigned bits)
+        // One extra word, so that get never reads past the end.
+        : words_((n * bits + 63) / 64 + 1),
+          bits_(bits),
+          mask_(bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1) {}
+
+    packed_array(const packed_array&) = delete;
+    packed_array& operator=(const packed_array&) = delete;
+    packed_array(packed_array&&) = delete;
+    packed_array& operator=(packed_array&&) = delete;
+
+    /**
+     * Stores v at index i. The position must not have been set before.
+     */
+    void set(size_t i, uint64_t v) {
+        v &= mask_;
+        uint64_t pos = uint64_t(i) * bits_;
+        unsigned shift = pos % 64;
+        words_[pos / 64] |= v << shift;
+        if (shift + bits_ > 64) words_[pos / 64 + 1] |= v >> (64 - shift);
+    }
+
+    /**
+     * The value at index i. Reads the two words the value may span and
+     * shifts the value out of them, without branches.
+     */
+    uint64_t get(size_t i) const {
+        uint64_t pos = uint64_t(i) * bits_;
+        unsigned shift = pos % 64;
+        uint64_t lo = words_[pos / 64] >> shift;
+        // Shifting by 64 is undefined, so the high word is shifted in two
+        // steps.
+        uint64_t hi = words_[pos / 64 + 1] << (63 - shift) << 1;
+        return (lo | hi) & mask_;
+    }
+
+    /**
+     * @return Bytes the array takes, see include/mem_usage.hpp.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + detail::heap_bytes(words_);
+    }
+};
+
+}  // namespace pfp
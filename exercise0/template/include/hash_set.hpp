@@ -0,0 +1,315 @@
+/**
+ * Open addressing hash set for non-negative integers.
+ *
+ * std::unordered_set allocates a node for every element and chains the nodes
+ * of a bucket into a linked list, so every lookup follows at least one
+ * pointer to a random place in memory. Here the keys are stored directly in
+ * one flat array, and a lookup usually touches a single cache line:
+ *
+ * - The table is split into groups of one 64 byte cache line, 16 int keys
+ *   or 8 64-bit keys. A key hashes to a home group, and probing moves on
+ *   group by group (linear probing, in steps of whole cache lines).
+ * - A group is searched all at once with SIMD compares, both for the key and
+ *   for empty slots. A lookup stops at the first group that contains the key
+ *   or an empty slot, since an insertion would have used that empty slot.
+ * - Empty slots hold -1, which is never inserted (negative values are the
+ *   markers of the input).
+ * - The table size is a power of two and the hash is a single
+ *   multiplication (Fibonacci hashing), the top bits of the product select
+ *   the home group.
+ *
+ * The table doubles when it becomes 3/4 full.
+ *
+ * Erasing a key from a group that has an empty slot simply empties its slot
+ * again: no lookup has ever moved past a group with an empty slot. Only in
+ * groups that once overflowed does the slot become a tombstone (-2), which
+ * lookups step over and insertions reuse. At a load of at most 3/4 few
+ * groups ever overflow, and the tombstones are dropped whenever the table is
+ * rebuilt.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integer this set stores. Values must be
+ *               non-negative.
+ */
+template <class dtype>
+class hash_set {
+   private:
+    static constexpr dtype empty = dtype(-1);
+    static constexpr dtype tombstone = dtype(-2);
+    static constexpr unsigned group_bytes = 64;
+    static constexpr size_t group_size = group_bytes / sizeof(dtype);
+    static constexpr unsigned initial_group_bits = 4;
+
+    dtype* keys_ = nullptr;
+    // log2 of the number of groups.
+    unsigned group_bits_ = 0;
+    size_t groups_ = 0;
+    size_t size_ = 0;
+    size_t max_size_ = 0;
+    size_t tombstones_ = 0;
+
+    static dtype* new_table(size_t groups) {
+        void* p = std::aligned_alloc(group_bytes, groups * group_bytes);
+        if (p == nullptr) throw std::bad_alloc();
+        // All bytes 0xff is -1 in every slot.
+        std::memset(p, 0xff, groups * group_bytes);
+        return static_cast<dtype*>(p);
+    }
+
+    size_t home(dtype value) const {
+        // Fibonacci hashing: multiply by 2^64 / golden ratio and keep the
+        // top bits, which depend on all bits of the value.
+        return (uint64_t(value) * 0x9e3779b97f4a7c15ULL) >> (64 - group_bits_);
+    }
+
+    /**
+     * Searches a group for value and for empty slots.
+     *
+     * @param found Set to true iff value is in the group.
+     * @return Bit mask of the empty slots of the group.
+     */
+    static uint32_t probe(const dtype* g, dtype value, bool& found) {
+#if defined(__AVX2__)
+        if constexpr (sizeof(dtype) == 4) {
+            const __m256i* p = reinterpret_cast<const __m256i*>(g);
+            __m256i a = _mm256_load_si256(p);
+            __m256i b = _mm256_load_si256(p + 1);
+            __m256i v = _mm256_set1_epi32(int32_t(value));
+            __m256i e = _mm256_set1_epi32(-1);
+            auto mask = [](__m256i x) {
+                return uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(x)));
+            };
+            uint32_t hit = mask(_mm256_cmpeq_epi32(a, v)) |
+                           mask(_mm256_cmpeq_epi32(b, v)) << 8;
+            found = hit != 0;
+            return mask(_mm256_cmpeq_epi32(a, e)) |
+                   mask(_mm256_cmpeq_epi32(b, e)) << 8;
+        }
+        if constexpr (sizeof(dtype) == 8) {
+            // The same with 8 keys of 64 bits per group.
+            const __m256i* p = reinterpret_cast<const __m256i*>(g);
+            __m256i a = _mm256_load_si256(p);
+            __m256i b = _mm256_load_si256(p + 1);
+            __m256i v = _mm256_set1_epi64x(int64_t(value));
+            __m256i e = _mm256_set1_epi64x(-1);
+            auto mask = [](__m256i x) {
+                return uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(x)));
+            };
+            uint32_t hit = mask(_mm256_cmpeq_epi64(a, v)) |
+                           mask(_mm256_cmpeq_epi64(b, v)) << 4;
+            found = hit != 0;
+            return mask(_mm256_cmpeq_epi64(a, e)) |
+                   mask(_mm256_cmpeq_epi64(b, e)) << 4;
+        }
+#endif
+        uint32_t free_slots = 0;
+        bool hit = false;
+        for (size_t i = 0; i < group_size; ++i) {
+            hit |= g[i] == value;
+            free_slots |= uint32_t(g[i] == empty) << i;
+        }
+        found = hit;
+        return free_slots;
+    }
+
+    /**
+     * Puts value in the first empty slot of its probe sequence. Does not
+     * check for duplicates.
+     */
+    void place(dtype* keys, dtype value) {
+        size_t g = home(value);
+        while (true) {
+            dtype* grp = keys + g * group_size;
+            bool found;
+            uint32_t free_slots = probe(grp, value, found);
+            if (free_slots != 0) {
+                grp[__builtin_ctz(free_slots)] = value;
+                return;
+            }
+            g = (g + 1) & (groups_ - 1);
+        }
+    }
+
+    void resize(unsigned group_bits) {
+        dtype* old = keys_;
+        size_t old_groups = groups_;
+        group_bits_ = group_bits;
+        groups_ = size_t(1) << group_bits;
+        keys_ = new_table(groups_);
+        max_size_ = groups_ * group_size / 4 * 3;
+        tombstones_ = 0;
+        for (size_t i = 0; i < old_groups * group_size; ++i) {
+            if (old[i] >= 0) place(keys_, old[i]);
+        }
+        std::free(old);
+    }
+
+    /**
+     * Insertion while there are tombstones: value may still be in a later
+     * group, so the whole probe sequence is searched before the first
+     * tombstone or empty slot on it is used.
+     */
+    void insert_reusing(dtype value) {
+        dtype* slot = nullptr;
+        size_t g = home(value);
+        while (true) {
+            dtype* grp = keys_ + g * group_size;
+            bool found;
+            uint32_t free_slots = probe(grp, value, found);
+            if (found) return;
+            for (size_t i = 0; i < group_size && slot == nullptr; ++i) {
+                if (grp[i] == tombstone) slot = grp + i;
+            }
+            if (free_slots != 0) {
+                if (slot == nullptr) {
+                    slot = grp + __builtin_ctz(free_slots);
+                } else {
+                    --tombstones_;
+                }
+                break;
+            }
+            g = (g + 1) & (groups_ - 1);
+        }
+        *slot = value;
+        if (++size_ + tombstones_ > max_size_) {
+            // Mostly tombstones are cleaned up without growing.
+            resize(group_bits_ + (size_ > max_size_ / 2));
+        }
+    }
+
+   public:
+    hash_set() { resize(initial_group_bits); }
+
+    ~hash_set() { std::free(keys_); }
+
+    hash_set(const hash_set&) = delete;
+    hash_set& operator=(const hash_set&) = delete;
+    hash_set(hash_set&&) = delete;
+    hash_set& operator=(hash_set&&) = delete;
+
+    /**
+     * Inserts value. Duplicates are ignored.
+     *
+     * @param value Element to be inserted. Must not be negative.
+     */
+    void insert(dtype value) {
+        if (tombstones_ > 0) [[unlikely]] {
+            insert_reusing(value);
+            return;
+        }
+        size_t g = home(value);
+        while (true) {
+            dtype* grp = keys_ + g * group_size;
+            bool found;
+            uint32_t free_slots = probe(grp, value, found);
+            if (found) return;
+            if (free_slots != 0) [[likely]] {
+                grp[__builtin_ctz(free_slots)] = value;
+                if (++size_ > max_size_) [[unlikely]] {
+                    resize(group_bits_ + 1);
+                }
+                return;
+            }
+            g = (g + 1) & (groups_ - 1);
+        }
+    }
+
+    /**
+     * Removes value, if it is in the set.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        size_t g = home(value);
+        while (true) {
+            dtype* grp = keys_ + g * group_size;
+            bool found;
+            uint32_t free_slots = probe(grp, value, found);
+            if (found) {
+                size_t i = 0;
+                while (grp[i] != value) ++i;
+                if (free_slots != 0) {
+                    grp[i] = empty;
+                } else {
+                    grp[i] = tombstone;
+                    ++tombstones_;
+                }
+                --size_;
+                return;
+            }
+            if (free_slots != 0) return;
+            g = (g + 1) & (groups_ - 1);
+        }
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        size_t g = home(value);
+        while (true) {
+            bool found;
+            uint32_t free_slots = probe(keys_ + g * group_size, value, found);
+            if (found) return 1;
+            if (free_slots != 0) [[likely]] {
+                return 0;
+            }
+            g = (g + 1) & (groups_ - 1);
+        }
+    }
+
+    /**
+     * Calls f(value) for every value in the set, in no particular order.
+     */
+    template <class F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < groups_ * group_size; ++i) {
+            if (keys_[i] >= 0) f(keys_[i]);
+        }
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp), the whole
+     *         table.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + groups_ * group_bytes;
+    }
+
+    /**
+     * Batched count, see batch.hpp. Prefetches the home group of the query
+     * 16 positions ahead. Almost all lookups finish in the home group, so
+     * this hides nearly all cache misses of large tables.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 16;
+        size_t i = 0;
+        for (; i + ahead < n; ++i) {
+            __builtin_prefetch(keys_ + home(vals[i + ahead]) * group_size);
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+};
+
+}  // namespace pfp
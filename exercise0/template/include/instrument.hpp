@@ -0,0 +1,98 @@
+/**
+ * Counters for instrumented runs (--stats of query.cpp).
+ *
+ * The --bench mode measures phases by running them separately, which needs
+ * the input in a file and changes what is measured. An instrumented run
+ * executes the normal operation loop instead and counts what happens on the
+ * way: insertions and how many of them were already in the set, queries and
+ * how many of them were found, erasures and set operations, switches
+ * between runs, and the time stamp counter cycles spent parsing, inserting,
+ * querying, erasing, combining sets and writing results. The summary is
+ * one line of JSON on stderr, so that it can be collected next to the
+ * normal output.
+ *
+ * Instrumentation is a template parameter of the operation loop, and the
+ * instrumented loops are only compiled into binaries built with "make stats"
+ * (-DPFP_STATS). Normal builds do not contain the counting code at all.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace pfp {
+
+/**
+ * @return The time stamp counter, or nanoseconds on other architectures.
+ */
+inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * What an instrumented run did.
+ */
+struct op_stats {
+    uint64_t inserts = 0;
+    // Insertions of values that were already in the set, or that came
+    // earlier in the same run.
+    uint64_t duplicate_inserts = 0;
+    uint64_t queries = 0;
+    uint64_t hits = 0;
+    uint64_t erases = 0;
+    // Unions, intersections and differences, and the values of their
+    // second sets.
+    uint64_t set_ops = 0;
+    uint64_t set_op_values = 0;
+    // Switches between runs: the markers of text input.
+    // Binary streams and the reader thread of -a only keep the switches
+    // between runs that have values.
+    uint64_t mode_switches = 0;
+    // Cycles per phase, and for the whole run including the bookkeeping.
+    uint64_t parse_cycles = 0;
+    uint64_t insert_cycles = 0;
+    uint64_t query_cycles = 0;
+    uint64_t erase_cycles = 0;
+    uint64_t set_op_cycles = 0;
+    uint64_t output_cycles = 0;
+    uint64_t total_cycles = 0;
+    // Wall time of the whole run, to convert cycles to time.
+    uint64_t total_ns = 0;
+
+    /**
+     * Writes the counters as one line of JSON.
+     *
+     * @param structure Name of the data structure.
+     */
+    void print_json(std::ostream& os, const char* structure) const {
+        os << "{\"structure\": \"" << structure << "\", \"inserts\": "
+           << inserts << ", \"duplicate_inserts\": " << duplicate_inserts
+           << ", \"queries\": " << queries << ", \"hits\": " << hits
+           << ", \"erases\": " << erases << ", \"set_ops\": " << set_ops
+           << ", \"set_op_values\": " << set_op_values
+           << ", \"mode_switches\": " << mode_switches
+           << ", \"cycles\": {\"parse\": " << parse_cycles
+           << ", \"insert\": " << insert_cycles
+           << ", \"query\": " << query_cycles
+           << ", \"erase\": " << erase_cycles
+           << ", \"set_op\": " << set_op_cycles
+           << ", \"output\": " << output_cycles
+           << ", \"total\": " << total_cycles
+           << "}, \"total_ns\": " << total_ns << "}" << std::endl;
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,79 @@
+/**
+ * Read-only memory mapping of an input file.
+ *
+ * Mapping the whole file lets the parser walk the bytes directly without
+ * copying them through a stream buffer first. Pipes and terminals can not be
+ * mapped, so callers should check ok() and fall back to read(2).
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+
+namespace pfp {
+
+class mapped_file {
+   private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool ok_ = false;
+
+   public:
+    /**
+     * Creates an empty mapping that is not ok().
+     */
+    mapped_file() {}
+
+    /**
+     * Maps the file at path. MAP_POPULATE asks the kernel to fault in the
+     * whole file up front, which is much cheaper than taking one page fault
+     * per 4 KiB while parsing.
+     *
+     * @param path Path of the file to map.
+     */
+    explicit mapped_file(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size_ = st.st_size;
+            if (size_ == 0) {
+                ok_ = true;
+            } else {
+                void* p = mmap(nullptr, size_, PROT_READ,
+                               MAP_PRIVATE | MAP_POPULATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    madvise(p, size_, MADV_SEQUENTIAL);
+                    data_ = static_cast<const char*>(p);
+                    ok_ = true;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    ~mapped_file() {
+        if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    mapped_file(mapped_file&&) = delete;
+    mapped_file& operator=(mapped_file&&) = delete;
+
+    /**
+     * @return true iff the file is a regular file that was mapped.
+     */
+    bool ok() const { return ok_; }
+
+    const char* data() const { return data_; }
+
+    size_t size() const { return size_; }
+};
+
+}  // namespace pfp
@@ -0,0 +1,167 @@
+/**
+ * How much memory the structures take, for --bench --mem-report.
+ *
+ * Every pfp:: structure has a member
+ *
+ *     size_t bytes_used() const
+ *
+ * that returns the bytes it holds right now: the object itself and
+ * everything it allocated. Reserved space counts in full, like the spare
+ * capacity of a std::vector, the free slots of a hash table or the free
+ * nodes of an arena. So do the pages of a large bit vector that were never
+ * touched, even though the kernel has not backed them with memory yet:
+ * bytes_used is what the structure asked for, which is what it takes once
+ * its values are spread out. The bookkeeping of malloc itself (16 bytes or
+ * so per allocation) is not counted.
+ *
+ * std::set and std::unordered_set do not tell how much they allocate, so
+ * for measuring they get pfp::counting_alloc, which adds up all
+ * allocations through it in pfp::heap_counter and remembers the peak.
+ * pfp::counted<set_t> is set_t with that allocator (and any other set
+ * as it is), and pfp::bytes_used(qs) works for both kinds.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace pfp {
+
+/**
+ * Bytes allocated through pfp::counting_alloc, now and at most since
+ * reset_peak. Not thread safe: meant for measuring one set at a time.
+ */
+struct heap_counter {
+    static inline size_t current = 0;
+    static inline size_t peak = 0;
+
+    /**
+     * Starts a new measurement of the peak.
+     */
+    static void reset_peak() { peak = current; }
+};
+
+/**
+ * std::allocator that counts in pfp::heap_counter.
+ */
+template <class T>
+struct counting_alloc {
+    using value_type = T;
+
+    counting_alloc() = default;
+
+    template <class U>
+    counting_alloc(const counting_alloc<U>&) {}
+
+    T* allocate(size_t n) {
+        T* p = std::allocator<T>().allocate(n);
+        size_t now = heap_counter::current += n * sizeof(T);
+        heap_counter::peak = std::max(heap_counter::peak, now);
+        return p;
+    }
+
+    void deallocate(T* p, size_t n) {
+        heap_counter::current -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    // All counting allocators share the counter, so any of them can free
+    // what another one allocated.
+    template <class U>
+    bool operator==(const counting_alloc<U>&) const {
+        return true;
+    }
+    template <class U>
+    bool operator!=(const counting_alloc<U>&) const {
+        return false;
+    }
+};
+
+/**
+ * set_t, with pfp::counting_alloc for the standard library sets.
+ */
+template <class set_t>
+struct counted {
+    using type = set_t;
+};
+
+template <class T, class C, class A>
+struct counted<std::set<T, C, A>> {
+    using type = std::set<T, C, counting_alloc<T>>;
+};
+
+template <class T, class H, class E, class A>
+struct counted<std::unordered_set<T, H, E, A>> {
+    using type = std::unordered_set<T, H, E, counting_alloc<T>>;
+};
+
+namespace detail {
+
+/**
+ * Bytes a vector has allocated, used or not.
+ */
+template <class T>
+size_t heap_bytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+template <class qs_t, class = void>
+struct has_bytes_used : std::false_type {};
+
+template <class qs_t>
+struct has_bytes_used<qs_t,
+                      decltype(void(std::declval<const qs_t&>().bytes_used()))>
+    : std::true_type {};
+
+template <class qs_t, class = void>
+struct is_counted : std::false_type {};
+
+template <class qs_t>
+struct is_counted<qs_t, std::enable_if_t<std::is_same<
+                            typename qs_t::allocator_type,
+                            counting_alloc<typename qs_t::value_type>>::value>>
+    : std::true_type {};
+
+}  // namespace detail
+
+/**
+ * Bytes qs takes, see the top of the file. For a set with
+ * pfp::counting_alloc, this is everything counted so far, so it must be
+ * the only one alive.
+ *
+ * @return The bytes, or 0 for sets that can not tell.
+ */
+template <class query_structure>
+size_t bytes_used(const query_structure& qs) {
+    if constexpr (detail::has_bytes_used<query_structure>::value) {
+        return qs.bytes_used();
+    } else if constexpr (detail::is_counted<query_structure>::value) {
+        return sizeof(qs) + heap_counter::current;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Most bytes qs has taken since heap_counter::reset_peak, for sets with
+ * pfp::counting_alloc. Like for bytes_used, it must be the only one alive.
+ *
+ * @return The bytes, or 0 for other sets.
+ */
+template <class query_structure>
+size_t peak_bytes(const query_structure& qs) {
+    if constexpr (detail::is_counted<query_structure>::value) {
+        return sizeof(qs) + heap_counter::peak;
+    } else {
+        return 0;
+    }
+}
+
+}  // namespace pfp
@@ -0,0 +1,247 @@
+/**
+ * NUMA nodes, threads placed on them and node local memory.
+ *
+ * A machine with several sockets has a memory controller on every socket,
+ * and each socket (a NUMA node) reaches the memory of the others only over
+ * the link between them. Loads from a remote node take up to twice as long
+ * and share that link's bandwidth. A large set allocated by one thread sits
+ * on that thread's node, so threads on the other nodes pay for every query.
+ *
+ * The kernel exposes the nodes in /sys/devices/system/node, and a thread
+ * can ask for its memory to come from one node with set_mempolicy(2).
+ * Memory is placed when a page is first touched, by the policy of the
+ * thread that touches it. Both are used here directly, like the counters
+ * of include/bench.hpp, without depending on libnuma.
+ */
+
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pfp {
+
+/**
+ * One NUMA node and its CPUs.
+ */
+struct numa_node {
+    // Number of the node for the kernel.
+    int id;
+    std::vector<int> cpus;
+};
+
+namespace detail {
+
+/**
+ * Parses a list like "0-3,8,10-11", the format of the cpulist and online
+ * files in sysfs.
+ */
+inline std::vector<int> parse_list(const std::string& s) {
+    std::vector<int> out;
+    size_t i = 0;
+    while (i < s.size()) {
+        int lo = 0;
+        bool digits = false;
+        for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+            lo = lo * 10 + (s[i] - '0');
+            digits = true;
+        }
+        if (!digits) break;
+        int hi = lo;
+        if (i < s.size() && s[i] == '-') {
+            hi = 0;
+            for (++i; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+                hi = hi * 10 + (s[i] - '0');
+            }
+        }
+        for (int x = lo; x <= hi; ++x) out.push_back(x);
+        if (i < s.size() && s[i] == ',') ++i;
+    }
+    return out;
+}
+
+/**
+ * @return The first line of a file, or "" if it can not be read.
+ */
+inline std::string read_line(const std::string& path) {
+    std::FILE* f = std::fopen(path.c_str(), "r");
+    if (f == nullptr) return "";
+    char buf[4096];
+    std::string line = std::fgets(buf, sizeof(buf), f) ? buf : "";
+    std::fclose(f);
+    return line;
+}
+
+}  // namespace detail
+
+/**
+ * @return The online nodes that have CPUs, in order. Without NUMA (or
+ *         without sysfs) a single node 0 with the CPUs this process may
+ *         run on.
+ */
+inline std::vector<numa_node> numa_nodes() {
+    const std::string dir = "/sys/devices/system/node/";
+    std::vector<numa_node> nodes;
+    for (int id : detail::parse_list(detail::read_line(dir + "online"))) {
+        std::vector<int> cpus = detail::parse_list(detail::read_line(
+            dir + "node" + std::to_string(id) + "/cpulist"));
+        // Nodes of memory only, e.g. CXL expanders, get no threads.
+        if (!cpus.empty()) nodes.push_back({id, std::move(cpus)});
+    }
+    if (nodes.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        std::vector<int> cpus;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int c = 0; c < CPU_SETSIZE; ++c) {
+                if (CPU_ISSET(c, &set)) cpus.push_back(c);
+            }
+        }
+        nodes.push_back({0, std::move(cpus)});
+    }
+    return nodes;
+}
+
+/**
+ * Makes the calling thread run only on cpus. Nothing happens for an empty
+ * list.
+ *
+ * @return false iff the kernel refused.
+ */
+inline bool pin_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) {
+        if (c < CPU_SETSIZE) CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * Makes the pages that the calling thread touches first come from node id,
+ * or from other nodes once it is full.
+ *
+ * @return false iff the kernel refused, e.g. one without NUMA support.
+ */
+inline bool prefer_node(int id) {
+    constexpr int word_bits = sizeof(unsigned long) * 8;
+    unsigned long mask[1024 / word_bits] = {};
+    if (id < 0 || id >= 1024) return false;
+    mask[id / word_bits] |= 1UL << (id % word_bits);
+    // The kernel takes one bit less than maxnode says.
+    return syscall(__NR_set_mempolicy, MPOL_PREFERRED, mask,
+                   sizeof(mask) * 8 + 1) == 0;
+}
+
+/**
+ * Worker threads spread over NUMA nodes, one per CPU of every node. Each
+ * thread is pinned to the CPUs of its node and allocates from its memory.
+ * Unlike pfp::thread_pool, the calling thread does not take part, since it
+ * may run anywhere.
+ */
+class node_threads {
+   public:
+    using job_t = std::function<void(size_t node, unsigned k, unsigned n)>;
+
+   private:
+    std::vector<numa_node> nodes_;
+    std::vector<std::thread> threads_;
+    std::mutex m_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    const job_t* job_ = nullptr;
+    size_t busy_ = 0;
+    // Incremented for every job, like in pfp::thread_pool.
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+
+    void worker(size_t node, unsigned k, unsigned n) {
+        pin_thread(nodes_[node].cpus);
+        prefer_node(nodes_[node].id);
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                start_.wait(lock,
+                            [&]() { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            (*job_)(node, k, n);
+            std::lock_guard<std::mutex> lock(m_);
+            if (--busy_ == 0) done_.notify_one();
+        }
+    }
+
+   public:
+    /**
+     * Starts the threads.
+     *
+     * @param nodes Nodes to start threads on, usually numa_nodes(). A node
+     *              without CPUs gets one thread that is not pinned.
+     */
+    explicit node_threads(std::vector<numa_node> nodes)
+        : nodes_(std::move(nodes)) {
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            unsigned n = std::max<size_t>(1, nodes_[i].cpus.size());
+            for (unsigned k = 0; k < n; ++k) {
+                threads_.emplace_back(
+                    [this, i, k, n]() { worker(i, k, n); });
+            }
+        }
+    }
+
+    ~node_threads() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (std::thread& t : threads_) t.join();
+    }
+
+    node_threads(const node_threads&) = delete;
+    node_threads& operator=(const node_threads&) = delete;
+    node_threads(node_threads&&) = delete;
+    node_threads& operator=(node_threads&&) = delete;
+
+    /**
+     * @return Number of nodes.
+     */
+    size_t nodes() const { return nodes_.size(); }
+
+    /**
+     * Calls f(node, k, n) on every thread, where the thread is the k-th of
+     * the n threads of node, and returns when all calls have finished. Only
+     * one thread may call run at a time.
+     */
+    void run(const job_t& f) {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            job_ = &f;
+            busy_ = threads_.size();
+            ++generation_;
+        }
+        start_.notify_all();
+        std::unique_lock<std::mutex> lock(m_);
+        done_.wait(lock, [&]() { return busy_ == 0; });
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,421 @@
+/**
+ * Binary operation stream format.
+ *
+ * Text input has to be parsed digit by digit, even with a fast parser. The
+ * binary format stores the same operations as raw integers that can be
+ * memory mapped and used directly. Like the files written by
+ * exercise2/nums.py it starts with a header of native (little endian) uint64
+ * words with n and the limit first:
+ *
+ * word 0           n      Number of values (insertions + queries).
+ * word 1           limit  Highest value in the stream.
+ * word 2           width  Bytes per value, 4 or 8.
+ * word 3           runs   Number of runs, r.
+ * words 4..4+r            Run descriptors. The operation (see pfp::op) is
+ *                         stored in the high 8 bits and the number of values
+ *                         in the run in the low 56 bits.
+ * after that              n values of width bytes each, zero padded to a
+ *                         multiple of 8 bytes.
+ *
+ * A text file like "1 2 -1 3 -1 4" becomes three runs: insert 2 values,
+ * query 1 value, insert 1 value. The run descriptors take the place of the
+ * markers of the text format (see pfp::op_mode).
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "reader.hpp"
+
+namespace pfp {
+
+/**
+ * Operations of a run in a binary operation stream.
+ *
+ * insert, query  Every value is inserted, or looked up with one result.
+ * erase          Every value is removed, if it is in the set.
+ * unite, intersect, subtract
+ *                The values of the run are a second set, and the set
+ *                becomes its union, intersection or difference with it (see
+ *                include/set_ops.hpp). Every run of these is one operation
+ *                of its own, also an empty one: intersecting with an empty
+ *                run empties the set.
+ */
+enum class op : uint8_t {
+    insert = 0,
+    query = 1,
+    erase = 2,
+    unite = 3,
+    intersect = 4,
+    subtract = 5
+};
+
+/**
+ * @return true iff runs of o are the second set of a set operation.
+ */
+inline bool is_set_op(op o) { return o >= op::unite; }
+
+/**
+ * Follows the markers of the text format:
+ *
+ * -2         Starts a run of erasures.
+ * -3         Starts the second set of a union,
+ * -4         of an intersection,
+ * -5         or of a difference, which ends at the next marker.
+ * -1         Switches between insertion and query mode. After an erasure
+ *            or set operation run, it switches relative to the insertion
+ *            or query mode before that run. So do all other negative
+ *            numbers, as they always did.
+ *
+ * The stream starts in insertion mode. "1 2 3 -2 2 -1 2" inserts 1, 2 and
+ * 3, erases 2 and then queries 2.
+ */
+class op_mode {
+   private:
+    op mode_ = op::insert;
+    // Insert or query, whichever -1 switches away from.
+    op base_ = op::insert;
+
+   public:
+    /**
+     * @return The operation of the values that follow.
+     */
+    op current() const { return mode_; }
+
+    /**
+     * Applies a marker.
+     *
+     * @param m A negative number.
+     */
+    void marker(int64_t m) {
+        if (m <= -int64_t(op::erase) && m >= -int64_t(op::subtract)) {
+            mode_ = op(-m);
+            return;
+        }
+        base_ = base_ == op::insert ? op::query : op::insert;
+        mode_ = base_;
+    }
+
+    /**
+     * The next marker on the way to a run of o, for turning runs back into
+     * markers. Insert and query runs take up to two of them (from an
+     * erasure run back to the mode before it), set operations always one.
+     */
+    static int64_t marker_to(op o) {
+        return o >= op::erase ? -int64_t(o) : -1;
+    }
+};
+
+namespace detail {
+
+constexpr unsigned op_shift = 56;
+constexpr uint64_t run_length_mask = (uint64_t(1) << op_shift) - 1;
+constexpr size_t op_header_words = 4;
+
+/**
+ * write(2) everything or fail.
+ */
+inline bool write_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+}  // namespace detail
+
+/**
+ * Reads a binary operation stream with the same interface as pfp::reader.
+ *
+ * Files are memory mapped, other inputs (like standard input) are read into
+ * memory in full. Either way no parsing happens: next() simply walks the value
+ * array and reports a marker whenever a run with a different operation
+ * starts.
+ *
+ * @tparam dtype Type of integers to read.
+ */
+template <class dtype>
+class binary_reader {
+   private:
+    mapped_file map_;
+    std::vector<uint64_t> buf_;
+    const uint64_t* runs_ = nullptr;
+    const uint64_t* runs_end_ = nullptr;
+    const uint32_t* v32_ = nullptr;
+    const uint64_t* v64_ = nullptr;
+    uint64_t n_ = 0;
+    uint64_t limit_ = 0;
+    uint64_t pos_ = 0;
+    uint64_t left_ = 0;
+    // For next: the operation of the current run, whether its markers have
+    // been reported and what they have switched to.
+    op run_ = op::insert;
+    bool entered_ = true;
+    op_mode mode_;
+    bool ok_ = false;
+
+    /**
+     * Checks the header and sets up the pointers into the value array.
+     */
+    void init(const char* data, size_t size) {
+        constexpr size_t header_bytes = detail::op_header_words * 8;
+        if (size < header_bytes) return;
+        const uint64_t* words = reinterpret_cast<const uint64_t*>(data);
+        n_ = words[0];
+        limit_ = words[1];
+        uint64_t width = words[2];
+        uint64_t r = words[3];
+        if ((width != 4 && width != 8) || r > size / 8) return;
+        size_t value_bytes = (n_ * width + 7) / 8 * 8;
+        if (size != header_bytes + r * 8 + value_bytes) return;
+        runs_ = words + detail::op_header_words;
+        runs_end_ = runs_ + r;
+        uint64_t total = 0;
+        for (const uint64_t* p = runs_; p < runs_end_; ++p) {
+            total += *p & detail::run_length_mask;
+            if ((*p >> detail::op_shift) > uint64_t(op::subtract)) return;
+        }
+        if (total != n_) return;
+        if (width == 4) {
+            v32_ = reinterpret_cast<const uint32_t*>(runs_end_);
+        } else {
+            v64_ = runs_end_;
+        }
+        ok_ = true;
+    }
+
+    /**
+     * Reads everything from fd into memory.
+     */
+    void load(int fd) {
+        size_t size = 0;
+        buf_.resize(size_t(1) << 17);
+        while (true) {
+            if (size == buf_.size() * 8) buf_.resize(buf_.size() * 2);
+            ssize_t n = read(fd, reinterpret_cast<char*>(buf_.data()) + size,
+                             buf_.size() * 8 - size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size += n;
+        }
+        init(reinterpret_cast<const char*>(buf_.data()), size);
+    }
+
+   public:
+    /**
+     * Reads the whole stream from a file descriptor, e.g. standard input.
+     *
+     * @param fd File descriptor to read from. Not closed by the reader.
+     */
+    explicit binary_reader(int fd) { load(fd); }
+
+    /**
+     * Maps the stream stored in the file at path.
+     *
+     * @param path File to read operations from.
+     */
+    explicit binary_reader(const char* path) : map_(path) {
+        if (map_.ok()) {
+            init(map_.data(), map_.size());
+        } else {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) return;
+            load(fd);
+            close(fd);
+        }
+    }
+
+    binary_reader(const binary_reader&) = delete;
+    binary_reader& operator=(const binary_reader&) = delete;
+    binary_reader(binary_reader&&) = delete;
+    binary_reader& operator=(binary_reader&&) = delete;
+
+    /**
+     * @return false iff the input could not be opened or is not a valid
+     *         binary operation stream.
+     */
+    bool ok() const { return ok_; }
+
+    /**
+     * @return The limit stored in the header.
+     */
+    uint64_t limit() const { return limit_; }
+
+    /**
+     * Calls f(o, values, n) for every run of the stream, where o is the
+     * operation of the run and values points to its n values, as uint32_t or
+     * uint64_t depending on the width of the stream. Does not move the read
+     * position.
+     */
+    template <class F>
+    void for_each_run(F&& f) const {
+        uint64_t start = 0;
+        for (const uint64_t* r = runs_; r < runs_end_; ++r) {
+            op o = op(*r >> detail::op_shift);
+            uint64_t n = *r & detail::run_length_mask;
+            if (v32_ != nullptr) {
+                f(o, v32_ + start, n);
+            } else {
+                f(o, v64_ + start, n);
+            }
+            start += n;
+        }
+    }
+
+    /**
+     * @return True iff values are stored as dtype, so that next_run can hand
+     *         them out without conversion.
+     */
+    bool direct() const {
+        return sizeof(dtype) == 4 ? v32_ != nullptr
+                                  : sizeof(dtype) == 8 && v64_ != nullptr;
+    }
+
+    /**
+     * Reads the rest of the current run, or the next run, at once. Empty
+     * runs are skipped, except for set operations. Only for direct()
+     * streams. Can not be mixed with next().
+     *
+     * @param o      Output for the operation of the run.
+     * @param values Output for the values of the run, in the mapped stream.
+     * @param n      Output for the number of values.
+     * @return false at the end of the stream.
+     */
+    bool next_run(op& o, const dtype*& values, uint64_t& n) {
+        while (entered_ && left_ == 0) {
+            if (runs_ == runs_end_) return false;
+            run_ = op(*runs_ >> detail::op_shift);
+            left_ = *runs_++ & detail::run_length_mask;
+            entered_ = left_ == 0 && !is_set_op(run_);
+        }
+        // Signed and unsigned integers of the same size may alias.
+        const void* base = v32_ != nullptr ? static_cast<const void*>(v32_)
+                                           : static_cast<const void*>(v64_);
+        o = run_;
+        values = static_cast<const dtype*>(base) + pos_;
+        n = left_;
+        pos_ += left_;
+        left_ = 0;
+        entered_ = true;
+        return true;
+    }
+
+    /**
+     * Reads the next token. Markers (see pfp::op_mode) are reported
+     * between runs with different operations, and before every set
+     * operation run.
+     *
+     * @param val Output for the integer that was read.
+     * @return The kind of token that was read.
+     */
+    token next(dtype& val) {
+        while (left_ == 0 || !entered_) [[unlikely]] {
+            if (!entered_) {
+                if (mode_.current() != run_ || is_set_op(run_)) {
+                    int64_t m = op_mode::marker_to(run_);
+                    mode_.marker(m);
+                    entered_ = mode_.current() == run_;
+                    val = dtype(m);
+                    return token::marker;
+                }
+                entered_ = true;
+                continue;
+            }
+            if (runs_ == runs_end_) return token::end;
+            run_ = op(*runs_ >> detail::op_shift);
+            left_ = *runs_++ & detail::run_length_mask;
+            entered_ = left_ == 0 && !is_set_op(run_);
+        }
+        --left_;
+        val = v32_ != nullptr ? dtype(v32_[pos_]) : dtype(v64_[pos_]);
+        ++pos_;
+        return token::value;
+    }
+};
+
+/**
+ * Collects operations and writes them as a binary operation stream.
+ */
+class op_stream_writer {
+   private:
+    std::vector<uint64_t> runs_;
+    std::vector<uint64_t> values_;
+    uint64_t limit_ = 0;
+    op_mode mode_;
+
+   public:
+    /**
+     * Adds a value to the current run.
+     */
+    void value(uint64_t val) {
+        op o = mode_.current();
+        if (runs_.empty() ||
+            op(runs_.back() >> detail::op_shift) != o) [[unlikely]] {
+            runs_.push_back(uint64_t(o) << detail::op_shift);
+        }
+        ++runs_.back();
+        values_.push_back(val);
+        limit_ = val > limit_ ? val : limit_;
+    }
+
+    /**
+     * Applies a marker of the text format (see pfp::op_mode). A set
+     * operation starts a run right away, since it counts even without
+     * values.
+     *
+     * @param m A negative number.
+     */
+    void marker(int64_t m) {
+        mode_.marker(m);
+        op o = mode_.current();
+        if (is_set_op(o)) runs_.push_back(uint64_t(o) << detail::op_shift);
+    }
+
+    /**
+     * @return The number of bytes per value that will be used: 4 if all values
+     *         fit into 32 bits, otherwise 8.
+     */
+    unsigned width() const { return limit_ > UINT32_MAX ? 8 : 4; }
+
+    /**
+     * Writes the stream.
+     *
+     * @param fd           File descriptor to write to.
+     * @param force_width  Bytes per value. 0 picks the smallest valid width.
+     * @return false iff writing failed or force_width is too small for the
+     *         values.
+     */
+    bool write(int fd, unsigned force_width = 0) const {
+        unsigned w = force_width == 0 ? width() : force_width;
+        if (w < width() || (w != 4 && w != 8)) return false;
+        uint64_t header[detail::op_header_words] = {values_.size(), limit_, w,
+                                                    runs_.size()};
+        if (!detail::write_all(fd, header, sizeof(header))) return false;
+        if (!detail::write_all(fd, runs_.data(), runs_.size() * 8)) {
+            return false;
+        }
+        if (w == 8) {
+            return detail::write_all(fd, values_.data(), values_.size() * 8);
+        }
+        std::vector<uint32_t> narrow(values_.begin(), values_.end());
+        if (narrow.size() % 2 == 1) narrow.push_back(0);
+        return detail::write_all(fd, narrow.data(), narrow.size() * 4);
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,78 @@
+/**
+ * Page granular allocation straight from the kernel.
+ *
+ * Large bitmaps and tables are allocated with mmap instead of malloc so that
+ * we get to decide how the pages are backed. Anonymous mappings are zero
+ * filled by the kernel, either on first touch (lazily) or up front.
+ */
+
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace pfp {
+
+// Size of a transparent huge page on x86-64.
+constexpr size_t huge_page_size = size_t(1) << 21;
+
+/**
+ * Allocates zero filled memory that is backed by transparent huge pages
+ * where possible.
+ *
+ * With populate = false pages are only allocated and zeroed when first
+ * touched, so memory use grows with the range that is actually used. With
+ * populate = true everything is faulted in immediately, which avoids taking
+ * page faults later in timing critical loops.
+ *
+ * @param bytes    Number of bytes to allocate.
+ * @param populate Fault in all pages up front.
+ * @return Pointer to the memory. Throws std::bad_alloc on failure.
+ */
+inline void* page_alloc(size_t bytes, bool populate) {
+    if (bytes == 0) bytes = 1;
+    // Huge pages need 2 MiB aligned addresses. Over-allocate and return
+    // the unused ends to the kernel.
+    size_t padded = bytes >= huge_page_size ? bytes + huge_page_size : bytes;
+    void* p = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    char* start = static_cast<char*>(p);
+    if (padded != bytes) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = (addr + huge_page_size - 1) & ~(huge_page_size - 1);
+        start = reinterpret_cast<char*>(aligned);
+        size_t head = aligned - addr;
+        size_t tail = padded - head - bytes;
+        if (head > 0) munmap(p, head);
+        if (tail > 0) munmap(start + bytes, tail);
+        madvise(start, bytes, MADV_HUGEPAGE);
+    }
+    if (populate) {
+#if defined(MADV_POPULATE_WRITE)
+        if (madvise(start, bytes, MADV_POPULATE_WRITE) != 0)
+#endif
+        {
+            // Older kernels. Writing a zero still faults the page in.
+            for (size_t i = 0; i < bytes; i += 4096) {
+                static_cast<volatile char*>(start)[i] = 0;
+            }
+        }
+    }
+    return start;
+}
+
+/**
+ * Returns memory from page_alloc to the kernel.
+ *
+ * @param p     Pointer returned by page_alloc.
+ * @param bytes The same size that was given to page_alloc.
+ */
+inline void page_free(void* p, size_t bytes) {
+    if (p != nullptr) munmap(p, bytes == 0 ? 1 : bytes);
+}
+
+}  // namespace pfp
@@ -0,0 +1,302 @@
+/**
+ * Answering queries with several threads.
+ *
+ * While no insertions are happening, the data structures are read only and
+ * any number of threads can query them at once. A long run of queries (all
+ * of them with -s) is split into chunks that are answered concurrently with
+ * pfp::count_batch, each chunk writing its results to its own part of one
+ * result array. Writing that array out then keeps the original order.
+ *
+ * Structures whose queries can modify them (pfp::vs merges pending
+ * insertions on demand) provide a freeze() method, which does all pending
+ * work up front so that the following queries only read.
+ *
+ * Likewise, when all insertions are known up front (the -s case), a structure
+ * can be built from the whole insertion block at once with pfp::build_from,
+ * using the threads of the pool. Structures opt in with a member
+ *
+ *     void build_from(const dtype* begin, const dtype* end, thread_pool* pool)
+ *
+ * and pfp::build_from falls back to inserting the values one by one.
+ *
+ * A structure that places its threads itself (pfp::sharded runs them on the
+ * NUMA nodes of its shards) answers parallel queries with a member
+ *
+ *     void count_parallel(thread_pool& pool, const dtype* vals, size_t n,
+ *                         uint8_t* out)
+ *
+ * which pfp::count_parallel calls instead of splitting the queries up.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "batch.hpp"
+
+namespace pfp {
+
+/**
+ * Fixed set of worker threads that run parallel loops. The calling thread
+ * takes part in every loop, so a pool of size t starts t - 1 threads.
+ */
+class thread_pool {
+   private:
+    std::vector<std::thread> workers_;
+    std::mutex m_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    const std::function<void(size_t)>* job_ = nullptr;
+    size_t n_tasks_ = 0;
+    std::atomic<size_t> next_{0};
+    // Workers still busy with the current loop.
+    size_t busy_ = 0;
+    // Incremented for every loop, so workers can tell a new loop from a
+    // spurious wakeup.
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+
+    void work() {
+        size_t i;
+        while ((i = next_.fetch_add(1, std::memory_order_relaxed)) < n_tasks_) {
+            (*job_)(i);
+        }
+    }
+
+    void worker() {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                start_.wait(lock,
+                            [&]() { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(m_);
+            if (--busy_ == 0) done_.notify_one();
+        }
+    }
+
+   public:
+    /**
+     * @param threads Total number of threads, including the caller.
+     */
+    explicit thread_pool(unsigned threads) {
+        for (unsigned i = 1; i < threads; ++i) {
+            workers_.emplace_back([this]() { worker(); });
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (std::thread& t : workers_) t.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+    thread_pool(thread_pool&&) = delete;
+    thread_pool& operator=(thread_pool&&) = delete;
+
+    /**
+     * @return Number of threads, including the caller.
+     */
+    unsigned size() const { return workers_.size() + 1; }
+
+    /**
+     * Calls f(i) for every i < n, spread over all threads, and returns when
+     * all calls have finished. Tasks are handed out one at a time, so tasks
+     * of uneven cost balance out.
+     */
+    void run(size_t n, const std::function<void(size_t)>& f) {
+        if (workers_.empty()) {
+            for (size_t i = 0; i < n; ++i) f(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            job_ = &f;
+            n_tasks_ = n;
+            next_.store(0, std::memory_order_relaxed);
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        start_.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(m_);
+        done_.wait(lock, [&]() { return busy_ == 0; });
+    }
+};
+
+namespace detail {
+
+template <class qs_t, class = void>
+struct has_freeze : std::false_type {};
+
+template <class qs_t>
+struct has_freeze<qs_t, decltype(void(std::declval<qs_t&>().freeze()))>
+    : std::true_type {};
+
+template <class qs_t, class dtype, class = void>
+struct has_build_from : std::false_type {};
+
+template <class qs_t, class dtype>
+struct has_build_from<
+    qs_t, dtype,
+    decltype(void(std::declval<qs_t&>().build_from(
+        std::declval<const dtype*>(), std::declval<const dtype*>(),
+        std::declval<thread_pool*>())))> : std::true_type {};
+
+template <class qs_t, class dtype, class = void>
+struct has_count_parallel : std::false_type {};
+
+template <class qs_t, class dtype>
+struct has_count_parallel<
+    qs_t, dtype,
+    decltype(void(std::declval<qs_t&>().count_parallel(
+        std::declval<thread_pool&>(), std::declval<const dtype*>(),
+        std::declval<size_t>(), std::declval<uint8_t*>())))>
+    : std::true_type {};
+
+/**
+ * Merges piece p of pieces equally sized pieces of the output of merging the
+ * sorted ranges a[0, na) and b[0, nb) into out. Where a piece starts in a
+ * and b is found by binary search ("merge path"), so all pieces can be
+ * merged independently of each other.
+ */
+template <class dtype>
+void merge_piece(const dtype* a, size_t na, const dtype* b, size_t nb,
+                 dtype* out, size_t p, size_t pieces) {
+    size_t n = na + nb;
+    // Number of elements taken from a in the first k elements of the
+    // merged output.
+    auto co_rank = [&](size_t k) {
+        size_t lo = k > nb ? k - nb : 0;
+        size_t hi = std::min(k, na);
+        while (lo < hi) {
+            size_t i = (lo + hi) / 2;
+            if (a[i] < b[k - i - 1]) {
+                lo = i + 1;
+            } else {
+                hi = i;
+            }
+        }
+        return lo;
+    };
+    size_t k0 = n * p / pieces;
+    size_t k1 = n * (p + 1) / pieces;
+    size_t i0 = co_rank(k0);
+    size_t i1 = co_rank(k1);
+    std::merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), out + k0);
+}
+
+}  // namespace detail
+
+/**
+ * Sorts data[0, n) with all threads of pool. Every thread sorts a slice of
+ * its own, after which the slices are merged pairwise in rounds. Merges are
+ * split into pieces so that every round keeps all threads busy, even the
+ * last one, which merges just two slices.
+ *
+ * @param buf Scratch space for n elements.
+ * @return data or buf, whichever holds the sorted result.
+ */
+template <class dtype>
+dtype* parallel_sort(thread_pool& pool, dtype* data, size_t n, dtype* buf) {
+    size_t parts = pool.size();
+    std::vector<size_t> bounds(parts + 1);
+    for (size_t k = 0; k <= parts; ++k) bounds[k] = n * k / parts;
+    pool.run(parts, [&](size_t k) {
+        std::sort(data + bounds[k], data + bounds[k + 1]);
+    });
+    dtype* src = data;
+    dtype* dst = buf;
+    for (size_t width = 1; width < parts; width *= 2) {
+        // Merge m combines the slices [2 m width, 2 (m + 1) width) and is
+        // split into one piece per slice, about parts pieces in total.
+        size_t pieces = 2 * width;
+        size_t merges = (parts + pieces - 1) / pieces;
+        pool.run(merges * pieces, [&](size_t task) {
+            size_t k = task / pieces * pieces;
+            size_t lo = bounds[k];
+            size_t mid = bounds[std::min(parts, k + width)];
+            size_t hi = bounds[std::min(parts, k + pieces)];
+            detail::merge_piece(src + lo, mid - lo, src + mid, hi - mid,
+                                dst + lo, task % pieces, pieces);
+        });
+        std::swap(src, dst);
+    }
+    return src;
+}
+
+/**
+ * Makes queries on qs read only until the next insertion, by calling
+ * qs.freeze() if there is one.
+ */
+template <class query_structure>
+inline void freeze(query_structure& qs) {
+    if constexpr (detail::has_freeze<query_structure>::value) qs.freeze();
+}
+
+/**
+ * Inserts the values [begin, end) into qs, with qs.build_from if it exists.
+ *
+ * @param pool Threads to use, or nullptr.
+ */
+template <class query_structure, class dtype>
+inline void build_from(query_structure& qs, const dtype* begin,
+                       const dtype* end, thread_pool* pool) {
+    if constexpr (detail::has_build_from<query_structure, dtype>::value) {
+        qs.build_from(begin, end, pool);
+    } else {
+        for (const dtype* p = begin; p < end; ++p) qs.insert(*p);
+    }
+}
+
+/**
+ * Answers n queries with all threads of pool. Equivalent to
+ * pfp::count_batch(qs, vals, n, out). Uses qs.count_parallel if it exists.
+ */
+template <class query_structure, class dtype>
+void count_parallel(thread_pool& pool, query_structure& qs, const dtype* vals,
+                    size_t n, uint8_t* out) {
+    if constexpr (detail::has_count_parallel<query_structure, dtype>::value) {
+        qs.count_parallel(pool, vals, n, out);
+        return;
+    }
+    // A few chunks per thread to even out differences in query cost, but
+    // large enough chunks that handing them out is cheap.
+    constexpr size_t min_chunk = size_t(1) << 14;
+    size_t chunks = std::max<size_t>(
+        1, std::min<size_t>(size_t(pool.size()) * 4, n / min_chunk));
+    if (chunks == 1) {
+        count_batch(qs, vals, n, out);
+        return;
+    }
+    freeze(qs);
+    size_t chunk = (n + chunks - 1) / chunks;
+    pool.run(chunks, [&](size_t c) {
+        size_t begin = c * chunk;
+        size_t end = std::min(n, begin + chunk);
+        if (begin < end) {
+            count_batch(qs, vals + begin, end - begin, out + begin);
+        }
+    });
+}
+
+}  // namespace pfp
@@ -0,0 +1,230 @@
+/**
+ * Pipelined input for operation streams from pipes.
+ *
+ * A memory mapped file is parsed as fast as the parser runs, but input from a
+ * pipe or a socket arrives at the speed of the other end. Run on one thread,
+ * waiting for read(2), parsing and the set operations take turns, and each
+ * one leaves the other two idle. Here pfp::async_reader moves reading and
+ * parsing to a thread of its own, which decodes the input into blocks of
+ * runs (arrays of values that all get the same operation, as in the binary
+ * format of include/op_stream.hpp) while the main thread applies the blocks
+ * that are already done. The writer of include/writer.hpp can likewise hand
+ * its full buffers to an output thread (see pfp::writer).
+ *
+ * The blocks circulate between two pfp::channel queues (include/channel.hpp):
+ * the reader thread takes empty blocks from one, fills them and puts them
+ * into the other, and the main thread hands them back after applying them.
+ * A fixed number of blocks is allocated once, so a reader far ahead of the
+ * set waits for blocks to come back instead of buffering the whole input.
+ * Blocks are applied in the order they were read, so the operations keep
+ * the order of the stream.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "channel.hpp"
+#include "op_stream.hpp"
+#include "reader.hpp"
+
+namespace pfp {
+
+/**
+ * Reads and parses an operation stream on a separate thread.
+ *
+ * Hands out the stream as runs with next_run, like a direct
+ * pfp::binary_reader, or token by token with next. Unlike a binary stream, a
+ * long run may be cut into several runs of the same operation at block
+ * boundaries, and the values of a run are only valid until the next call.
+ * Set operation runs are never cut, their pieces are put back together.
+ *
+ * @tparam dtype  Type of integers to read.
+ * @tparam source Reader that does the parsing, e.g. pfp::reader<dtype>.
+ */
+template <class dtype, class source>
+class async_reader {
+   private:
+    static constexpr size_t block_size = size_t(1) << 16;
+    // Blocks in circulation: one being filled, one being applied and the
+    // rest waiting in between.
+    static constexpr size_t blocks = 8;
+
+    struct run {
+        op o;
+        size_t n;
+        // The set operation run goes on in the next block.
+        bool cut;
+    };
+
+    struct block {
+        std::vector<dtype> values;
+        std::vector<run> runs;
+
+        block() : values(block_size) {}
+    };
+
+    source& src_;
+    channel<block> empty_;
+    channel<block> full_;
+    std::unique_ptr<block> current_;
+    size_t piece_ = 0;
+    size_t pos_ = 0;
+    // The pieces of a set operation run that was cut.
+    std::vector<dtype> whole_;
+    // For next: the rest of the current run, and the markers like in
+    // pfp::binary_reader.
+    const dtype* values_ = nullptr;
+    uint64_t left_ = 0;
+    op run_ = op::insert;
+    bool entered_ = true;
+    op_mode mode_;
+    std::thread thread_;
+
+    /**
+     * Reader thread. Fills blocks until the end of the input or until the
+     * reader is destroyed.
+     */
+    void decode() {
+        op_mode mode;
+        token t = token::value;
+        while (t != token::end) {
+            std::unique_ptr<block> b = empty_.pop();
+            if (b == nullptr) return;
+            b->runs.clear();
+            size_t size = 0;
+            while (size < block_size && t != token::end) {
+                size_t start = size;
+                while (size < block_size &&
+                       (t = src_.next(b->values[size])) == token::value) {
+                    ++size;
+                }
+                op o = mode.current();
+                // A set operation run counts even without values, but a
+                // full block in the middle of one only cuts it.
+                if (size > start || (is_set_op(o) && t != token::value)) {
+                    bool cut = is_set_op(o) && t == token::value;
+                    b->runs.push_back({o, size - start, cut});
+                }
+                if (t == token::marker) mode.marker(int64_t(b->values[size]));
+            }
+            if (!full_.push(std::move(b))) return;
+        }
+        full_.close();
+    }
+
+   public:
+    /**
+     * Starts the reader thread.
+     *
+     * @param src Parser of the stream. Only used by the reader thread from
+     *            now on, until this reader is destroyed.
+     */
+    explicit async_reader(source& src)
+        : src_(src), empty_(blocks), full_(blocks) {
+        for (size_t i = 0; i < blocks; ++i) {
+            empty_.push(std::unique_ptr<block>(new block()));
+        }
+        thread_ = std::thread([this]() { decode(); });
+    }
+
+    /**
+     * Stops the reader thread, even if the input has not been read to the
+     * end.
+     */
+    ~async_reader() {
+        empty_.close();
+        full_.close();
+        thread_.join();
+    }
+
+    async_reader(const async_reader&) = delete;
+    async_reader& operator=(const async_reader&) = delete;
+    async_reader(async_reader&&) = delete;
+    async_reader& operator=(async_reader&&) = delete;
+
+    /**
+     * Runs are always handed out as arrays of dtype.
+     */
+    bool direct() const { return true; }
+
+    /**
+     * The next run of the blocks, as the reader thread stored it.
+     */
+    bool next_piece(run& r, const dtype*& values) {
+        while (current_ == nullptr || piece_ == current_->runs.size()) {
+            if (current_ != nullptr) empty_.push(std::move(current_));
+            current_ = full_.pop();
+            if (current_ == nullptr) return false;
+            piece_ = 0;
+            pos_ = 0;
+        }
+        r = current_->runs[piece_++];
+        values = current_->values.data() + pos_;
+        pos_ += r.n;
+        return true;
+    }
+
+    /**
+     * Reads the next run, waiting for the reader thread if needed. Can not
+     * be mixed with next.
+     *
+     * @param o      Output for the operation of the run.
+     * @param values Output for the values of the run. Valid until the next
+     *               call to next_run or next.
+     * @param n      Output for the number of values, at least 1 except for
+     *               set operations.
+     * @return false at the end of the stream.
+     */
+    bool next_run(op& o, const dtype*& values, uint64_t& n) {
+        run r;
+        if (!next_piece(r, values)) return false;
+        o = r.o;
+        n = r.n;
+        if (!r.cut) [[likely]] {
+            return true;
+        }
+        whole_.assign(values, values + r.n);
+        while (r.cut && next_piece(r, values)) {
+            whole_.insert(whole_.end(), values, values + r.n);
+        }
+        values = whole_.data();
+        n = whole_.size();
+        return true;
+    }
+
+    /**
+     * Reads the next token. Like pfp::binary_reader, markers (see
+     * pfp::op_mode) are reported between runs with different operations,
+     * and before every set operation run.
+     *
+     * @param val Output for the integer that was read.
+     * @return The kind of token that was read.
+     */
+    token next(dtype& val) {
+        while (left_ == 0 || !entered_) [[unlikely]] {
+            if (!entered_) {
+                if (mode_.current() != run_ || is_set_op(run_)) {
+                    int64_t m = op_mode::marker_to(run_);
+                    mode_.marker(m);
+                    entered_ = mode_.current() == run_;
+                    val = dtype(m);
+                    return token::marker;
+                }
+                entered_ = true;
+                continue;
+            }
+            if (!next_run(run_, values_, left_)) return token::end;
+            entered_ = false;
+        }
+        --left_;
+        val = *values_++;
+        return token::value;
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,164 @@
+/**
+ * Range sums for the sum queries of exercise2 (nums.py -a).
+ *
+ * A sum query q asks for the sum of all values that are at most q, counting
+ * repeated values every time. With values below a small limit (10^6 by
+ * default) the answers for all possible q fit in one table: add every value
+ * v into table[v], then turn the table into its prefix sums. A query is then
+ * a single load, and a batch of queries is a gather from the table, limited
+ * by memory bandwidth once the table no longer fits in the caches.
+ *
+ * The prefix sums are computed 4 words at a time with AVX2: each vector is
+ * scanned in registers with two shift-and-add steps, and the running total
+ * of the previous vectors is added with one broadcast. The in-register
+ * steps do not depend on the previous vector, so the only serial part is
+ * one add and one broadcast per 4 words.
+ *
+ * For limits much larger than the number of values the table would mostly
+ * repeat the same sums, so the values are sorted instead and a query is a
+ * binary search over their prefix sums.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "mem_usage.hpp"
+#include "page_alloc.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+/**
+ * Replaces a[0, n) with its inclusive prefix sums.
+ */
+inline void inclusive_scan(uint64_t* a, size_t n) {
+    size_t i = 0;
+    uint64_t total = 0;
+#if defined(__AVX2__)
+    __m256i carry = _mm256_setzero_si256();
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        __m256i* p = reinterpret_cast<__m256i*>(a + i);
+        __m256i x = _mm256_loadu_si256(p);
+        // [a, b, c, d] + [0, a, b, c], then + [0, 0, a, a + b].
+        __m256i s = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 3));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(s, zero, 0x03));
+        s = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 3, 2));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(s, zero, 0x0f));
+        x = _mm256_add_epi64(x, carry);
+        _mm256_storeu_si256(p, x);
+        carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    if (i > 0) total = a[i - 1];
+#endif
+    for (; i < n; ++i) {
+        total += a[i];
+        a[i] = total;
+    }
+}
+
+}  // namespace detail
+
+/**
+ * Sums of the values up to a bound, for a fixed array of values.
+ */
+class prefix_sum {
+   private:
+    // Tables up to this many entries are always used. Larger ones only if
+    // they take at most table_ratio words per value.
+    static constexpr uint64_t table_min = uint64_t(1) << 22;
+    static constexpr uint64_t table_ratio = 4;
+
+    // Dense case: table_[x] is the sum of all values <= x.
+    uint64_t* table_ = nullptr;
+    size_t entries_ = 0;
+    // Sparse case: the sorted values and sums_[i], the sum of the first i.
+    std::vector<uint64_t> sorted_;
+    std::vector<uint64_t> sums_;
+
+   public:
+    /**
+     * @param values The values. Not needed after construction.
+     * @param n      Number of values.
+     * @param limit  All values are smaller than this.
+     */
+    prefix_sum(const uint64_t* values, size_t n, uint64_t limit) {
+        if (limit <= table_min || limit / table_ratio <= n) {
+            entries_ = std::max<uint64_t>(limit, 1);
+            table_ = static_cast<uint64_t*>(
+                page_alloc(entries_ * sizeof(uint64_t), true));
+            for (size_t i = 0; i < n; ++i) table_[values[i]] += values[i];
+            detail::inclusive_scan(table_, entries_);
+        } else {
+            sorted_.assign(values, values + n);
+            std::sort(sorted_.begin(), sorted_.end());
+            sums_.resize(n + 1);
+            sums_[0] = 0;
+            for (size_t i = 0; i < n; ++i) {
+                sums_[i + 1] = sums_[i] + sorted_[i];
+            }
+        }
+    }
+
+    ~prefix_sum() { page_free(table_, entries_ * sizeof(uint64_t)); }
+
+    prefix_sum(const prefix_sum&) = delete;
+    prefix_sum& operator=(const prefix_sum&) = delete;
+    prefix_sum(prefix_sum&&) = delete;
+    prefix_sum& operator=(prefix_sum&&) = delete;
+
+    /**
+     * @return The sum of all values that are at most q.
+     */
+    uint64_t sum(uint64_t q) const {
+        if (table_ != nullptr) {
+            return table_[std::min<uint64_t>(q, entries_ - 1)];
+        }
+        size_t k = std::upper_bound(sorted_.begin(), sorted_.end(), q) -
+                   sorted_.begin();
+        return sums_[k];
+    }
+
+    /**
+     * Batched sum. For the table, the entries of the queries a few
+     * positions ahead are prefetched, so that many cache misses are in
+     * flight at once.
+     *
+     * @param qs  Queries.
+     * @param n   Number of queries.
+     * @param out Output for the n sums.
+     */
+    void sum_batch(const uint64_t* qs, size_t n, uint64_t* out) const {
+        if (table_ == nullptr) {
+            for (size_t i = 0; i < n; ++i) out[i] = sum(qs[i]);
+            return;
+        }
+        constexpr size_t ahead = 16;
+        uint64_t last = entries_ - 1;
+        size_t i = 0;
+        for (; i + ahead < n; ++i) {
+            __builtin_prefetch(table_ + std::min(qs[i + ahead], last));
+            out[i] = table_[std::min(qs[i], last)];
+        }
+        for (; i < n; ++i) out[i] = table_[std::min(qs[i], last)];
+    }
+
+    /**
+     * @return Bytes the sums take, see include/mem_usage.hpp.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + entries_ * sizeof(uint64_t) +
+               detail::heap_bytes(sorted_) + detail::heap_bytes(sums_);
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,592 @@
+/**
+ * Looking at the input before choosing a data structure.
+ *
+ * Which structure is fastest depends on the data: the largest value (a bit
+ * vector needs one bit per possible value), the number of distinct values,
+ * how they are distributed, whether insertions arrive sorted and how often
+ * inserts and queries alternate. Instead of relying on -l and -s, type 0
+ * measures these on the input file itself:
+ *
+ * Text files are memory mapped, so they can be looked at twice. One SIMD
+ * pass over the bytes counts lines (operations) and '-' characters
+ * (markers), and bounds the values from the length of the longest lines.
+ * Everything else comes from parsing 16 evenly spaced windows of a few
+ * thousand operations each. Binary streams need no parsing and are scanned
+ * in full.
+ *
+ * The bound is at most twice the largest value, too loose to tell whether
+ * the values need 64 bits. If it is above 2^31 - 1, the whole file is parsed
+ * once more for the exact maximum, also with -t (see pfp::text_max), so
+ * that no value is read into an int that it does not fit.
+ *
+ * The number of distinct values of a full scan is estimated with a
+ * HyperLogLog sketch. Sampled windows only see part of the insertions, few
+ * enough to count their distinct values exactly (the sketch's 1.6% error
+ * would drown the handful of duplicates a sample contains). The total is
+ * then extrapolated by assuming the insertions are random draws from some
+ * domain of N values, with N chosen to explain the duplicates in the sample.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "op_stream.hpp"
+#include "reader.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace pfp {
+
+/**
+ * HyperLogLog distinct count estimator with 2^12 registers, about 1.6%
+ * standard error in 4 KiB.
+ *
+ * Every value is hashed, the top 12 bits of the hash select a register and
+ * the register remembers the longest run of leading zeros seen in the
+ * remaining bits. Long runs are exponentially unlikely, so they tell how
+ * many different hashes were seen. See Flajolet et al. "HyperLogLog: the
+ * analysis of a near-optimal cardinality estimation algorithm".
+ */
+class hyperloglog {
+   private:
+    static constexpr unsigned p = 12;
+    static constexpr unsigned m = 1u << p;
+    uint8_t reg_[m] = {};
+
+   public:
+    void add(uint64_t value) {
+        // Murmur3 finalizer.
+        uint64_t h = value;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        unsigned idx = h >> (64 - p);
+        // A guard bit keeps the rank finite for an all zero remainder.
+        uint64_t rest = (h << p) | (uint64_t(1) << (p - 1));
+        uint8_t rank = __builtin_clzll(rest) + 1;
+        reg_[idx] = std::max(reg_[idx], rank);
+    }
+
+    double estimate() const {
+        double sum = 0;
+        unsigned zeros = 0;
+        for (unsigned i = 0; i < m; ++i) {
+            sum += std::ldexp(1.0, -reg_[i]);
+            zeros += reg_[i] == 0;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double e = alpha * m * m / sum;
+        // Small cardinalities: linear counting over the empty registers.
+        if (e <= 2.5 * m && zeros > 0) e = m * std::log(double(m) / zeros);
+        return e;
+    }
+};
+
+/**
+ * What the prescan found out about an input.
+ */
+struct data_profile {
+    // True iff the input could be scanned at all.
+    bool ok = false;
+    // True iff only parts of the input were parsed.
+    bool sampled = false;
+    // Upper bound on all values, see text_scan, exact if it is above 2^31 - 1
+    // (see text_max). The largest value for binary streams.
+    uint64_t max = 0;
+    uint64_t ops = 0;
+    uint64_t markers = 0;
+    // Estimated number of insertions and of distinct inserted values.
+    double inserts = 0;
+    double distinct = 0;
+    // Fraction of consecutive (parsed) insertions that are in order.
+    double sorted = 0;
+    // Estimated values per non-empty 2^16 value bucket.
+    double per_bucket = 0;
+};
+
+namespace detail {
+
+/**
+ * Accumulates the statistics of parsed operations.
+ */
+struct profile_builder {
+    hyperloglog values;
+    // One bit per 2^16 bucket of 32-bit values. Larger values share bits.
+    uint64_t buckets[1024] = {};
+    // Parsed insertions, kept for exact counts when sampling.
+    std::vector<uint64_t> sample;
+    bool keep_sample = false;
+    uint64_t parsed = 0;
+    uint64_t parsed_inserts = 0;
+    uint64_t in_order = 0;
+    uint64_t pairs = 0;
+    uint64_t max = 0;
+
+    /**
+     * Parses one stretch of operations.
+     *
+     * @param insert Whether the stretch starts in insert mode.
+     * @param limit  Stop after this many operations.
+     */
+    template <class input>
+    void scan(input& in, bool insert, uint64_t limit) {
+        bool have_last = false;
+        uint64_t last = 0;
+        uint64_t val;
+        for (uint64_t i = 0; i < limit; ++i) {
+            token t = in.next(val);
+            if (t == token::end) break;
+            if (t == token::marker) {
+                insert = !insert;
+                have_last = false;
+                continue;
+            }
+            ++parsed;
+            max = std::max(max, val);
+            if (!insert) continue;
+            ++parsed_inserts;
+            if (keep_sample) {
+                sample.push_back(val);
+            } else {
+                values.add(val);
+                uint64_t bucket = (val >> 16) & 0xffff;
+                buckets[bucket / 64] |= uint64_t(1) << (bucket % 64);
+            }
+            if (have_last) {
+                ++pairs;
+                in_order += val >= last;
+            }
+            last = val;
+            have_last = true;
+        }
+    }
+
+    /**
+     * Adds one run of n values of a binary stream. Runs are profiled in
+     * full, so the values go into the sketch instead of the sample.
+     */
+    template <class T>
+    void add_run(const T* v, uint64_t n, bool insert) {
+        parsed += n;
+        if (!insert) {
+            for (uint64_t i = 0; i < n; ++i) {
+                max = std::max<uint64_t>(max, v[i]);
+            }
+            return;
+        }
+        parsed_inserts += n;
+        pairs += n > 0 ? n - 1 : 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t val = v[i];
+            max = std::max(max, val);
+            values.add(val);
+            uint64_t bucket = (val >> 16) & 0xffff;
+            buckets[bucket / 64] |= uint64_t(1) << (bucket % 64);
+            in_order += i > 0 && val >= v[i - 1];
+        }
+    }
+};
+
+/**
+ * Expected number of distinct values among s random draws from N values.
+ */
+inline double expected_distinct(double n, double s) {
+    return n * -std::expm1(-s / n);
+}
+
+/**
+ * Extrapolates the number of distinct values in total draws from a sample
+ * of s draws with d distinct values. Finds the domain size N for which s
+ * draws give d distinct values on average, then evaluates total draws.
+ */
+inline double extrapolate_distinct(double d, double s, double total) {
+    if (s <= 0) return 0;
+    d = std::min(d, s);
+    if (d >= s * 0.999 || total <= s) return d / s * total;
+    double lo = d;
+    double hi = 1e18;
+    for (int i = 0; i < 200 && hi / lo > 1.0001; ++i) {
+        double mid = std::sqrt(lo * hi);
+        if (expected_distinct(mid, s) < d) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return expected_distinct(lo, total);
+}
+
+/**
+ * Upper bound on the values of a text input, plus line and marker counts.
+ *
+ * A line of k bytes holds no number with more than k digits, and a k digit
+ * number that fills a line is less than (first digit + 1) * 10^(k - 1). So
+ * the longest line and the largest first byte among the longest lines bound
+ * every value in the input by at most twice the real maximum. Lines are
+ * found 64 bytes at a time as a bit mask of newlines. Most blocks only
+ * contain lines that are shorter than the longest, or exactly as long but not
+ * starting with a larger byte, which a few mask operations rule out for the
+ * whole block. Only the line that crosses into the block is looked at by
+ * itself.
+ */
+struct text_scan {
+    uint64_t lines = 0;
+    uint64_t minus = 0;
+    size_t longest = 0;
+    // Largest first byte of the lines that are longest bytes long.
+    char lead = 0;
+
+    void end_line(const char* s, size_t len) {
+        if (len > longest) {
+            longest = len;
+            lead = s[0];
+        } else if (len == longest && len > 0) {
+            lead = std::max(lead, s[0]);
+        }
+    }
+
+#if defined(__AVX2__)
+    static uint64_t mask(const char* p, char c) {
+        __m256i v = _mm256_set1_epi8(c);
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, v))) |
+               uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, v))))
+                   << 32;
+    }
+
+    static uint64_t mask_greater(const char* p, char c) {
+        __m256i v = _mm256_set1_epi8(c);
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        return uint32_t(_mm256_movemask_epi8(_mm256_cmpgt_epi8(a, v))) |
+               uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpgt_epi8(b, v))))
+                   << 32;
+    }
+#endif
+
+    /**
+     * @return Bits p of x such that bits p to p + n - 1 are all set.
+     */
+    static uint64_t runs(uint64_t x, size_t n) {
+        if (n > 64) return 0;
+        size_t have = 1;
+        while (2 * have <= n) {
+            x &= x >> have;
+            have *= 2;
+        }
+        if (have < n) x &= x >> (n - have);
+        return x;
+    }
+
+    /**
+     * Scans data[0, size), which starts at the start of a line. Segments
+     * that do not end the input must end with a newline.
+     */
+    void run(const char* data, size_t size) {
+        const char* line_start = data;
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 64 <= size; i += 64) {
+            const char* block = data + i;
+            uint64_t nl = mask(block, '\n');
+            minus += __builtin_popcountll(mask(block, '-'));
+            if (nl == 0) continue;
+            lines += __builtin_popcountll(nl);
+            unsigned first = __builtin_ctzll(nl);
+            unsigned last = 63 - __builtin_clzll(nl);
+            end_line(line_start, block + first - line_start);
+            line_start = block + last + 1;
+            if (first == last) continue;
+            // Bytes of the lines that start and end in this block.
+            uint64_t inner = ~nl & (~uint64_t(0) << first) &
+                             (~uint64_t(0) >> (63 - last));
+            bool check = longest == 0 || runs(inner, longest + 1) != 0;
+            if (!check && longest < 64) {
+                uint64_t starts = nl << 1 & runs(inner, longest) &
+                                  nl >> longest;
+                check = (starts & mask_greater(block, lead)) != 0;
+            }
+            if (check) [[unlikely]] {
+                uint64_t rest = nl & (nl - 1);
+                unsigned prev = first;
+                while (rest != 0) {
+                    unsigned p = __builtin_ctzll(rest);
+                    end_line(block + prev + 1, p - prev - 1);
+                    prev = p;
+                    rest &= rest - 1;
+                }
+            }
+        }
+#endif
+        for (; i < size; ++i) {
+            minus += data[i] == '-';
+            if (data[i] == '\n') {
+                ++lines;
+                end_line(line_start, data + i - line_start);
+                line_start = data + i + 1;
+            }
+        }
+        if (line_start < data + size) {
+            ++lines;
+            end_line(line_start, data + size - line_start);
+        }
+    }
+
+    /**
+     * @return Upper bound on all values, or UINT64_MAX for numbers that
+     *         could be too large to represent.
+     */
+    uint64_t bound() const {
+        if (longest == 0) return 0;
+        if (longest > 19) return UINT64_MAX;
+        unsigned top = lead < '0' ? 0 : lead > '9' ? 9 : lead - '0';
+        uint64_t scale = 1;
+        for (size_t i = 1; i < longest; ++i) scale *= 10;
+        if (top == 9 && longest == 19) return UINT64_MAX;
+        return (top + 1) * scale - 1;
+    }
+};
+
+/**
+ * Largest absolute value of the numbers in data[0, size), up to the first
+ * token that is not a number, like the readers. UINT64_MAX for numbers that
+ * do not fit 64 bits.
+ */
+inline uint64_t parsed_max(const char* data, size_t size) {
+    reader<uint64_t> in(data, size);
+    uint64_t max = 0;
+    uint64_t val;
+    token t;
+    while ((t = in.next(val)) != token::end) {
+        // Markers are negated by the reader.
+        max = std::max(max, t == token::marker ? 0 - val : val);
+    }
+    return max;
+}
+
+/**
+ * The bound of a text_scan over data[0, size) if it fits 32 bits, and the
+ * exact maximum otherwise.
+ */
+inline uint64_t text_max(const text_scan& ts, const char* data, size_t size) {
+    uint64_t bound = ts.bound();
+    if (bound <= uint64_t(INT32_MAX)) return bound;
+    return parsed_max(data, size);
+}
+
+inline void finish(data_profile& prof, profile_builder& b) {
+    prof.ok = true;
+    uint64_t values = prof.ops - std::min(prof.ops, prof.markers);
+    double insert_share =
+        b.parsed > 0 ? double(b.parsed_inserts) / b.parsed : 1.0;
+    prof.inserts = insert_share * values;
+    prof.sorted = b.pairs > 0 ? double(b.in_order) / b.pairs : 1.0;
+    double buckets;
+    if (b.keep_sample) {
+        std::vector<uint64_t>& v = b.sample;
+        std::sort(v.begin(), v.end());
+        double s = v.size();
+        double d = std::unique(v.begin(), v.end()) - v.begin();
+        v.resize(size_t(d));
+        for (uint64_t& x : v) x >>= 16;
+        double db = std::unique(v.begin(), v.end()) - v.begin();
+        if (prof.sorted >= 0.99) {
+            // A window of sorted insertions holds neighbouring values, which
+            // repeat about as often as they do in the whole input, and
+            // only touches one or two buckets. Assume the insertions cover
+            // the buckets up to the maximum instead.
+            prof.distinct = s > 0 ? d / s * prof.inserts : 0;
+            buckets = double(prof.max >> 16) + 1;
+        } else {
+            prof.distinct = extrapolate_distinct(d, s, prof.inserts);
+            buckets = extrapolate_distinct(db, d, prof.distinct);
+        }
+    } else {
+        prof.distinct = std::min(b.values.estimate(), prof.inserts);
+        buckets = 0;
+        for (uint64_t w : b.buckets) buckets += __builtin_popcountll(w);
+    }
+    if (prof.max < UINT64_MAX) {
+        prof.distinct = std::min(prof.distinct, double(prof.max) + 1);
+    }
+    buckets = std::max(1.0, std::min(buckets, prof.distinct));
+    prof.per_bucket = prof.distinct / buckets;
+}
+
+}  // namespace detail
+
+/**
+ * Profiles a text input file. Fails (ok = false) for files that can not be
+ * memory mapped.
+ */
+inline data_profile profile_text(const char* path) {
+    constexpr unsigned windows = 16;
+    constexpr uint64_t window_ops = 2048;
+    data_profile prof;
+    mapped_file map(path);
+    if (!map.ok()) return prof;
+    const char* data = map.data();
+    size_t size = map.size();
+
+    // Windows start at a line start. The number of markers before a window
+    // tells whether it starts in insert or in query mode.
+    size_t starts[windows + 1];
+    uint64_t minus_before[windows];
+    for (unsigned w = 0; w < windows; ++w) {
+        size_t s = size * w / windows;
+        if (w > 0) {
+            const void* nl = std::memchr(data + s, '\n', size - s);
+            s = nl == nullptr ? size : static_cast<const char*>(nl) - data + 1;
+        }
+        starts[w] = std::max(s, w > 0 ? starts[w - 1] : 0);
+    }
+    starts[windows] = size;
+    detail::text_scan ts;
+    for (unsigned w = 0; w < windows; ++w) {
+        minus_before[w] = ts.minus;
+        ts.run(data + starts[w], starts[w + 1] - starts[w]);
+    }
+    prof.ops = ts.lines;
+    prof.markers = ts.minus;
+    prof.max = detail::text_max(ts, data, size);
+
+    detail::profile_builder b;
+    b.keep_sample = true;
+    b.sample.reserve(windows * window_ops);
+    for (unsigned w = 0; w < windows; ++w) {
+        reader<uint64_t> in(data + starts[w], starts[w + 1] - starts[w]);
+        b.scan(in, minus_before[w] % 2 == 0, window_ops);
+    }
+    prof.sampled = b.parsed < prof.ops - std::min(prof.ops, prof.markers);
+    detail::finish(prof, b);
+    return prof;
+}
+
+/**
+ * Largest value of a text input file, or a bound of at most 2^31 - 1 on
+ * it, without the rest of the profile. For choosing between 32 and 64-bit
+ * values when the type is given.
+ *
+ * @param max Output for the value.
+ * @return false iff the file can not be memory mapped.
+ */
+inline bool text_max(const char* path, uint64_t& max) {
+    mapped_file map(path);
+    if (!map.ok()) return false;
+    detail::text_scan ts;
+    ts.run(map.data(), map.size());
+    max = detail::text_max(ts, map.data(), map.size());
+    return true;
+}
+
+/**
+ * Profiles a binary operation stream by scanning all of it.
+ */
+inline data_profile profile_binary(const char* path) {
+    data_profile prof;
+    binary_reader<uint64_t> in(path);
+    if (!in.ok()) return prof;
+    detail::profile_builder b;
+    op mode = op::insert;
+    in.for_each_run([&](op o, const auto* values, uint64_t n) {
+        // Markers only separate non-empty runs, like in next().
+        if (o != mode && n > 0) {
+            ++prof.markers;
+            mode = o;
+        }
+        b.add_run(values, n, o == op::insert);
+    });
+    prof.ops = b.parsed + prof.markers;
+    prof.max = b.max;
+    detail::finish(prof, b);
+    return prof;
+}
+
+/**
+ * A data structure choice and the reasoning behind it.
+ */
+struct choice {
+    int type;
+    uint64_t limit;
+    std::string reason;
+};
+
+/**
+ * Picks a data structure type for an input with profile prof.
+ *
+ * bv       if the bit vector is small: at most 32 MiB, or at most 4 times
+ *          the ~8 bytes per value a hash set takes. Needs a bound on the
+ *          values.
+ * sparse   the same for the sparse bit vector, which only takes 8 KiB for
+ *          every occupied 2^16 bucket (plus its directory). For a few large
+ *          values among small ones, or values clustered in a few ranges.
+ * roaring  if occupied 2^16 buckets hold 2048 values or more on average, so
+ *          that containers are bitmaps or runs and far smaller than a hash
+ *          table. Such inputs pass the sparse bit vector test if there is a
+ *          bound on the values, so this is for inputs without one.
+ * vs       if all insertions come first and arrive in order, so that the
+ *          sorted vector is built without any sorting and takes 4 bytes per
+ *          value.
+ * hash     otherwise.
+ *
+ * @param limit Limit given with -l, or 0.
+ */
+inline choice choose(const data_profile& prof, uint64_t limit) {
+    std::ostringstream why;
+    why << "prescan" << (prof.sampled ? " (sampled)" : "") << ": " << prof.ops
+        << " operations, " << prof.markers << " markers, values <= "
+        << prof.max << ", ~"
+        << uint64_t(prof.distinct) << " distinct of ~"
+        << uint64_t(prof.inserts) << " insertions, "
+        << int(prof.sorted * 100) << "% of insertions in order, ~"
+        << uint64_t(prof.per_bucket) << " values per 2^16 bucket\n";
+    uint64_t max = limit > 0 ? limit : prof.max;
+    double bv_bytes = double(max) / 8;
+    double hash_bytes = prof.distinct * 8;
+    double buckets = prof.per_bucket > 0 ? prof.distinct / prof.per_bucket : 0;
+    double sparse_bytes = buckets * 8192 + double(max >> 16) * 12;
+    bool separate = prof.markers <= 1;
+    choice c{9, max, ""};
+    if (max < UINT64_MAX &&
+        (bv_bytes <= double(32 << 20) || bv_bytes <= 4 * hash_bytes)) {
+        c.type = 5;
+        why << "bit vector: " << uint64_t(bv_bytes / 1024)
+            << " KiB for values up to " << max;
+    } else if (max < UINT64_MAX &&
+               (sparse_bytes <= double(32 << 20) ||
+                sparse_bytes <= 4 * hash_bytes)) {
+        c.type = 10;
+        why << "sparse bit vector: " << uint64_t(sparse_bytes / 1024)
+            << " KiB for ~" << uint64_t(buckets) << " occupied 2^16 buckets";
+    } else if (prof.per_bucket >= 2048) {
+        c.type = 6;
+        why << "roaring container set: values are dense within their "
+               "2^16 buckets";
+    } else if (separate && prof.sorted >= 0.999) {
+        c.type = 4;
+        why << "sorted vector: insertions come first and in order";
+    } else {
+        why << "open addressing hash set: values are sparse";
+        if (!separate) why << " and inserts and queries are interleaved";
+    }
+    c.reason = why.str();
+    return c;
+}
+
+}  // namespace pfp
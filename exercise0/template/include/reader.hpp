@@ -0,0 +1,294 @@
+/**
+ * Fast reader for the decimal operation format used by query.cpp.
+ *
+ * std::istream::operator>> constructs a sentry, consults the locale and checks
+ * stream state for every single value. For two million short integers that
+ * overhead is larger than the actual set operations. This reader instead
+ * walks over a memory mapped file (or large read(2) chunks for pipes and
+ * terminals) and converts digits by hand, 16 bytes at a time where SSE4.1 is
+ * available.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "mapped_file.hpp"
+
+namespace pfp {
+
+/**
+ * Kinds of tokens that can be read from an operation stream.
+ *
+ * value  A non-negative integer to insert, query or erase.
+ * marker A negative integer, switching between modes (see pfp::op_mode in
+ *        include/op_stream.hpp).
+ * end    End of input (or the first token that is not an integer, or
+ *        that does not fit the type of the values).
+ */
+enum class token { value, marker, end };
+
+namespace detail {
+
+/**
+ * Scalar digit scanner. Reads digits starting at p but never at or past end.
+ * Numbers that do not fit 64 bits come out as UINT64_MAX, which is larger
+ * than any value the readers accept.
+ *
+ * @param p   First character of the number.
+ * @param end One past the last readable character.
+ * @param v   Output for the parsed value.
+ * @return Pointer to the first non-digit character (or end).
+ */
+inline const char* scan_digits_scalar(const char* p, const char* end,
+                                      uint64_t& v) {
+    constexpr uint64_t max = std::numeric_limits<uint64_t>::max();
+    uint64_t r = 0;
+    while (p < end) {
+        unsigned d = unsigned(*p) - '0';
+        if (d > 9) break;
+        // Stays at max once it got there.
+        r = r > (max - d) / 10 ? max : r * 10 + d;
+        ++p;
+    }
+    v = r;
+    return p;
+}
+
+#if defined(__SSE4_1__)
+/**
+ * SIMD digit scanner. Requires that 16 bytes starting at p are readable.
+ *
+ * The digit run is located with a single compare + movemask, shifted so that
+ * the last digit ends up in the last byte lane and then reduced with
+ * multiply-add instructions: pairs of digits, then groups of four, then
+ * groups of eight.
+ *
+ * @return Pointer to the first non-digit character, or nullptr if all 16
+ *         bytes were digits and the caller needs to fall back to the scalar
+ *         scanner. At most 15 digits are parsed here, which can not
+ *         overflow.
+ */
+inline const char* scan_digits_simd(const char* p, uint64_t& v) {
+    // Row k of the shuffle table starts at byte k. Loading 16 bytes from
+    // offset len gives a mask that moves input bytes [0, len) to output bytes
+    // [16 - len, 16) and zeroes the rest.
+    alignas(16) static const int8_t shuffle[32] = {
+        -128, -128, -128, -128, -128, -128, -128, -128,
+        -128, -128, -128, -128, -128, -128, -128, -128,
+        0,    1,    2,    3,    4,    5,    6,    7,
+        8,    9,    10,   11,   12,   13,   14,   15};
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i digits = _mm_sub_epi8(chunk, _mm_set1_epi8('0'));
+    // Unsigned digits - '0' is in [0, 9] only for actual digit characters.
+    __m128i is_digit =
+        _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+    unsigned mask = ~unsigned(_mm_movemask_epi8(is_digit)) & 0xFFFF;
+    if (mask == 0) [[unlikely]] {
+        return nullptr;
+    }
+    unsigned len = __builtin_ctz(mask);
+    __m128i sel =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffle + len));
+    digits = _mm_shuffle_epi8(digits, sel);
+    __m128i pairs = _mm_maddubs_epi16(digits, _mm_set1_epi16(0x010A));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00010064));
+    quads = _mm_packus_epi32(quads, quads);
+    __m128i octs = _mm_madd_epi16(quads, _mm_set1_epi32(0x00012710));
+    uint64_t hi = uint32_t(_mm_cvtsi128_si32(octs));
+    uint64_t lo = uint32_t(_mm_extract_epi32(octs, 1));
+    v = hi * 100000000 + lo;
+    return p + len;
+}
+#endif
+
+/**
+ * Parses the digit run starting at p, using the SIMD scanner when it is safe
+ * to read 16 bytes.
+ */
+inline const char* scan_digits(const char* p, const char* end, uint64_t& v) {
+#if defined(__SSE4_1__)
+    if (end - p >= 16) [[likely]] {
+        const char* q = scan_digits_simd(p, v);
+        if (q != nullptr) [[likely]] {
+            return q;
+        }
+    }
+#endif
+    return scan_digits_scalar(p, end, v);
+}
+
+inline bool is_space(char c) {
+    return c == '\n' || c == ' ' || c == '\r' || c == '\t' || c == '\v' ||
+           c == '\f';
+}
+
+}  // namespace detail
+
+/**
+ * Reads the operation stream from a file or file descriptor.
+ *
+ * Usage:
+ *
+ * pfp::reader<int> in("data.txt");
+ * int val;
+ * while (in.next(val) != pfp::token::end) { ... }
+ *
+ * @tparam dtype Type of integers to read.
+ */
+template <class dtype>
+class reader {
+   private:
+    // Size of a single read(2) when the input can not be mapped.
+    static constexpr size_t chunk_size = size_t(1) << 20;
+
+    mapped_file map_;
+    std::unique_ptr<char[]> buf_;
+    const char* pos_ = nullptr;
+    const char* end_ = nullptr;
+    int fd_ = -1;
+    bool own_fd_ = false;
+    bool eof_ = true;
+    bool ok_ = false;
+
+    void init_buffer() {
+        buf_.reset(new char[chunk_size]);
+        pos_ = end_ = buf_.get();
+        eof_ = false;
+        ok_ = true;
+    }
+
+    /**
+     * Moves the unconsumed tail of the buffer to the front and reads more
+     * data after it.
+     *
+     * @return false iff no more data could be read.
+     */
+    bool refill() {
+        if (eof_) return false;
+        size_t rest = end_ - pos_;
+        std::memmove(buf_.get(), pos_, rest);
+        pos_ = buf_.get();
+        end_ = pos_ + rest;
+        ssize_t n;
+        do {
+            n = read(fd_, buf_.get() + rest, chunk_size - rest);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            eof_ = true;
+            return false;
+        }
+        end_ += n;
+        return true;
+    }
+
+   public:
+    /**
+     * Reads from an already open file descriptor in large chunks. Used for
+     * standard input, which is usually a pipe or a terminal.
+     *
+     * @param fd File descriptor to read from. Not closed by the reader.
+     */
+    explicit reader(int fd) : fd_(fd) { init_buffer(); }
+
+    /**
+     * Maps the file at path if possible, otherwise falls back to chunked
+     * reads (for example for named pipes or /dev/stdin).
+     *
+     * @param path File to read operations from.
+     */
+    explicit reader(const char* path) : map_(path) {
+        if (map_.ok()) {
+            pos_ = map_.data();
+            end_ = pos_ + map_.size();
+            ok_ = true;
+            return;
+        }
+        fd_ = open(path, O_RDONLY);
+        if (fd_ < 0) return;
+        own_fd_ = true;
+        init_buffer();
+    }
+
+    /**
+     * Reads from text that is already in memory.
+     *
+     * @param data Start of the text. Must stay valid while reading.
+     * @param size Length of the text in bytes.
+     */
+    reader(const char* data, size_t size)
+        : pos_(data), end_(data + size), ok_(true) {}
+
+    ~reader() {
+        if (own_fd_) close(fd_);
+    }
+
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+    reader(reader&&) = delete;
+    reader& operator=(reader&&) = delete;
+
+    /**
+     * @return false iff the input could not be opened.
+     */
+    bool ok() const { return ok_; }
+
+    /**
+     * Reads the next token.
+     *
+     * Negative numbers are reported as markers with val set to the parsed
+     * (negative) number. "-0" is the value 0, the same as with operator>>.
+     * Like operator>>, a number that does not fit into dtype (e.g.
+     * 3000000000 for int) ends the input, instead of being wrapped around
+     * into a different value or a marker.
+     *
+     * @param val Output for the integer that was read.
+     * @return The kind of token that was read.
+     */
+    token next(dtype& val) {
+        while (true) {
+            while (pos_ < end_ && detail::is_space(*pos_)) ++pos_;
+            if (pos_ == end_) [[unlikely]] {
+                if (refill()) continue;
+                return token::end;
+            }
+            bool negative = *pos_ == '-';
+            const char* start = pos_ + negative;
+            uint64_t v;
+            const char* stop = detail::scan_digits(start, end_, v);
+            if (stop == end_ && !eof_) [[unlikely]] {
+                // The number may continue in the next chunk. Parse it again
+                // once more data is available (or the input has ended).
+                refill();
+                continue;
+            }
+            if (stop == start) [[unlikely]] {
+                // Not a number. operator>> would fail here.
+                return token::end;
+            }
+            if (v > uint64_t(std::numeric_limits<dtype>::max())) [[unlikely]] {
+                return token::end;
+            }
+            pos_ = stop;
+            if (negative && v != 0) [[unlikely]] {
+                val = -dtype(v);
+                return token::marker;
+            }
+            val = dtype(v);
+            return token::value;
+        }
+    }
+};
+
+}  // namespace pfp
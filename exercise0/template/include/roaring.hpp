@@ -0,0 +1,854 @@
+/**
+ * Roaring style container set.
+ *
+ * The 32-bit key space is split into 2^16 buckets by the high 16 bits of each
+ * value. Each bucket stores the low 16 bits of its values in whichever
+ * container is the most compact for the density of the bucket:
+ *
+ * array   A sorted array of up to 4096 uint16_t values. Used for sparse
+ *         buckets, which is almost all of them for uniformly random data.
+ * bitmap  A 2^16 bit (8 KiB) bitmap for dense buckets.
+ * run     A sorted array of [start, last] ranges. Used for buckets consisting
+ *         of long consecutive ranges, e.g. a full bucket is a single run.
+ *
+ * A query costs one load from the (cache resident) bucket directory followed
+ * by a search inside a single small container, and memory use is proportional
+ * to the number of values instead of the limit.
+ *
+ * Union, intersection and difference with another set combine the sets
+ * bucket by bucket. Arrays are merged, or filtered by lookups in the other
+ * container, and bitmaps and runs are combined as bitmaps, word by word. The
+ * result is stored in whichever container is the smallest for it.
+ *
+ * See Lemire et al. "Consistently faster and smaller compressed bitmaps with
+ * Roaring" for the original data structure.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "page_alloc.hpp"
+#include "snapshot.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+/**
+ * Branchless lower bound. Returns the index of the first element of the
+ * sorted array a[0, n) that is not less than val.
+ */
+template <class T>
+inline uint32_t lower_bound_index(const T* a, uint32_t n, T val) {
+    if (n == 0) return 0;
+    const T* base = a;
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base += (base[half - 1] < val) * half;
+        n -= half;
+    }
+    return uint32_t(base - a) + (*base < val);
+}
+
+/**
+ * The containers of a roaring set: one bucket of 2^16 values, stored as the
+ * low 16 bits of its values. Shared by pfp::roaring, which keeps the
+ * containers of all 2^16 buckets of the 32-bit range in a flat directory,
+ * and pfp::roaring64, which only keeps the buckets in use in a hash table.
+ */
+struct roaring_containers {
+    enum class kind : uint8_t { empty = 0, array, bitmap, run };
+
+    enum class set_op { unite, intersect, subtract };
+
+    struct range {
+        uint16_t start;
+        uint16_t last;
+    };
+
+    /**
+     * A bucket. All zeros is a valid empty bucket, so the directory can use
+     * lazily zeroed pages.
+     */
+    struct container {
+        void* data;
+        // Values in an array, set bits in a bitmap, ranges in a run
+        // container.
+        uint32_t size;
+        // Allocated array or run container capacity.
+        uint16_t cap;
+        kind k;
+    };
+
+    static constexpr uint32_t buckets = uint32_t(1) << 16;
+    static constexpr uint32_t bitmap_words = 1024;
+    // Arrays larger than this would take more space than a bitmap.
+    static constexpr uint32_t array_max = 4096;
+    // A full array is converted to a run container instead of a bitmap if it
+    // consists of at most this many ranges.
+    static constexpr uint32_t run_pick = 1024;
+    // Run containers larger than this are converted to bitmaps.
+    static constexpr uint32_t run_max = 2048;
+
+    /**
+     * A directory entry in a snapshot, with the data replaced by its
+     * position in the payload section.
+     */
+    struct stored {
+        uint32_t size;
+        uint16_t cap;
+        kind k;
+        uint8_t pad;
+    };
+
+    /**
+     * Bytes of data a snapshot stores for a container of the given size
+     * and kind.
+     */
+    static size_t payload_bytes(uint32_t size, kind k) {
+        switch (k) {
+            case kind::array:
+                return size * sizeof(uint16_t);
+            case kind::bitmap:
+                return bitmap_words * sizeof(uint64_t);
+            case kind::run:
+                return size * sizeof(range);
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Bytes allocated for the data of c, which can be more than
+     * payload_bytes.
+     */
+    static size_t data_bytes(const container& c) {
+        switch (c.k) {
+            case kind::array:
+                return c.cap * sizeof(uint16_t);
+            case kind::bitmap:
+                return bitmap_words * sizeof(uint64_t);
+            case kind::run:
+                return c.cap * sizeof(range);
+            default:
+                return 0;
+        }
+    }
+
+    static uint16_t* array_of(const container& c) {
+        return static_cast<uint16_t*>(c.data);
+    }
+    static uint64_t* bitmap_of(const container& c) {
+        return static_cast<uint64_t*>(c.data);
+    }
+    static range* runs_of(const container& c) {
+        return static_cast<range*>(c.data);
+    }
+
+    static void* grow(void* data, size_t bytes) {
+        void* p = std::realloc(data, bytes);
+        if (p == nullptr) throw std::bad_alloc();
+        return p;
+    }
+
+    static uint64_t* new_bitmap() {
+        void* p = std::aligned_alloc(64, bitmap_words * sizeof(uint64_t));
+        if (p == nullptr) throw std::bad_alloc();
+        std::memset(p, 0, bitmap_words * sizeof(uint64_t));
+        return static_cast<uint64_t*>(p);
+    }
+
+    /**
+     * Index of the first range that starts after low.
+     */
+    static uint32_t run_index(const container& c, uint16_t low) {
+        const range* r = runs_of(c);
+        return std::upper_bound(r, r + c.size, low,
+                                [](uint16_t v, const range& x) {
+                                    return v < x.start;
+                                }) -
+               r;
+    }
+
+    /**
+     * Replaces a full array container with a run or bitmap container,
+     * whichever is smaller.
+     */
+    static void convert_array(container& c) {
+        const uint16_t* a = array_of(c);
+        uint32_t n_runs = 1;
+        for (uint32_t i = 1; i < c.size; ++i) {
+            n_runs += a[i] != a[i - 1] + 1;
+        }
+        if (n_runs <= run_pick) {
+            uint32_t cap = 4;
+            while (cap < n_runs) cap *= 2;
+            range* r = static_cast<range*>(grow(nullptr, cap * sizeof(range)));
+            uint32_t j = 0;
+            r[0] = {a[0], a[0]};
+            for (uint32_t i = 1; i < c.size; ++i) {
+                if (a[i] == r[j].last + 1) {
+                    r[j].last = a[i];
+                } else {
+                    r[++j] = {a[i], a[i]};
+                }
+            }
+            std::free(c.data);
+            c = {r, n_runs, uint16_t(cap), kind::run};
+        } else {
+            uint64_t* b = new_bitmap();
+            for (uint32_t i = 0; i < c.size; ++i) {
+                b[a[i] / 64] |= uint64_t(1) << (a[i] % 64);
+            }
+            std::free(c.data);
+            c = {b, c.size, 0, kind::bitmap};
+        }
+    }
+
+    /**
+     * Replaces a run container with a bitmap container.
+     */
+    static void convert_run(container& c) {
+        uint64_t* b = new_bitmap();
+        uint32_t n = 0;
+        const range* r = runs_of(c);
+        for (uint32_t i = 0; i < c.size; ++i) {
+            for (uint32_t v = r[i].start; v <= r[i].last; ++v) {
+                b[v / 64] |= uint64_t(1) << (v % 64);
+            }
+            n += uint32_t(r[i].last) - r[i].start + 1;
+        }
+        std::free(c.data);
+        c = {b, n, 0, kind::bitmap};
+    }
+
+    /**
+     * Frees the data of c and leaves it empty.
+     */
+    static void clear(container& c) {
+        if (c.k != kind::empty) std::free(c.data);
+        c = container{};
+    }
+
+    /**
+     * @return A copy of c with data of its own.
+     */
+    static container copy_of(const container& c) {
+        if (c.k == kind::empty) return container{};
+        void* data;
+        if (c.k == kind::bitmap) {
+            data = new_bitmap();
+        } else {
+            size_t elem = c.k == kind::array ? sizeof(uint16_t) : sizeof(range);
+            data = grow(nullptr, std::max<size_t>(c.cap, 1) * elem);
+        }
+        std::memcpy(data, c.data, payload_bytes(c.size, c.k));
+        return {data, c.size, c.cap, c.k};
+    }
+
+    /**
+     * Sets the bits [start, last] of a bitmap.
+     */
+    static void set_range(uint64_t* b, uint32_t start, uint32_t last) {
+        uint64_t first = ~uint64_t(0) << (start % 64);
+        uint64_t end = ~uint64_t(0) >> (63 - last % 64);
+        uint32_t w = start / 64;
+        if (w == last / 64) {
+            b[w] |= first & end;
+            return;
+        }
+        b[w++] |= first;
+        for (; w < last / 64; ++w) b[w] = ~uint64_t(0);
+        b[w] |= end;
+    }
+
+    /**
+     * Writes the values of c to the bitmap b.
+     */
+    static void to_bitmap(const container& c, uint64_t* b) {
+        if (c.k == kind::bitmap) {
+            std::memcpy(b, c.data, bitmap_words * sizeof(uint64_t));
+            return;
+        }
+        std::memset(b, 0, bitmap_words * sizeof(uint64_t));
+        if (c.k == kind::array) {
+            const uint16_t* a = array_of(c);
+            for (uint32_t i = 0; i < c.size; ++i) {
+                b[a[i] / 64] |= uint64_t(1) << (a[i] % 64);
+            }
+        } else if (c.k == kind::run) {
+            const range* r = runs_of(c);
+            for (uint32_t i = 0; i < c.size; ++i) {
+                set_range(b, r[i].start, r[i].last);
+            }
+        }
+    }
+
+    /**
+     * Replaces c with the values of the bitmap b, which may be the data of
+     * c, in the smallest container for them.
+     */
+    static void from_bitmap(container& c, const uint64_t* b) {
+        uint32_t n = 0;
+        uint32_t n_runs = 0;
+        uint64_t carry = 0;
+        for (uint32_t w = 0; w < bitmap_words; ++w) {
+            n += __builtin_popcountll(b[w]);
+            // Set bits without a set bit right before them start a range.
+            n_runs += __builtin_popcountll(b[w] & ~(b[w] << 1 | carry));
+            carry = b[w] >> 63;
+        }
+        if (n == 0) {
+            clear(c);
+            return;
+        }
+        size_t array_bytes = n <= array_max ? n * sizeof(uint16_t) : SIZE_MAX;
+        size_t run_bytes =
+            n_runs <= run_max ? n_runs * sizeof(range) : SIZE_MAX;
+        container r;
+        if (array_bytes <= run_bytes &&
+            array_bytes < bitmap_words * sizeof(uint64_t)) {
+            uint32_t cap = 4;
+            while (cap < n) cap *= 2;
+            uint16_t* a = static_cast<uint16_t*>(
+                grow(nullptr, cap * sizeof(uint16_t)));
+            uint32_t j = 0;
+            for (uint32_t w = 0; w < bitmap_words; ++w) {
+                for (uint64_t x = b[w]; x != 0; x &= x - 1) {
+                    a[j++] = uint16_t(w * 64 + __builtin_ctzll(x));
+                }
+            }
+            r = {a, n, uint16_t(cap), kind::array};
+        } else if (run_bytes < bitmap_words * sizeof(uint64_t) ||
+                   n == buckets) {
+            uint32_t cap = 4;
+            while (cap < n_runs) cap *= 2;
+            range* x = static_cast<range*>(grow(nullptr, cap * sizeof(range)));
+            // The k-th start goes with the k-th end.
+            uint32_t starts = 0;
+            uint32_t ends = 0;
+            carry = 0;
+            for (uint32_t w = 0; w < bitmap_words; ++w) {
+                uint64_t next = w + 1 < bitmap_words ? b[w + 1] & 1 : 0;
+                uint64_t st = b[w] & ~(b[w] << 1 | carry);
+                uint64_t en = b[w] & ~(b[w] >> 1 | next << 63);
+                carry = b[w] >> 63;
+                for (; st != 0; st &= st - 1) {
+                    x[starts++].start = uint16_t(w * 64 + __builtin_ctzll(st));
+                }
+                for (; en != 0; en &= en - 1) {
+                    x[ends++].last = uint16_t(w * 64 + __builtin_ctzll(en));
+                }
+            }
+            r = {x, n_runs, uint16_t(cap), kind::run};
+        } else if (c.k == kind::bitmap) {
+            if (c.data != b) {
+                std::memcpy(c.data, b, bitmap_words * sizeof(uint64_t));
+            }
+            c.size = n;
+            return;
+        } else {
+            uint64_t* x = new_bitmap();
+            std::memcpy(x, b, bitmap_words * sizeof(uint64_t));
+            r = {x, n, 0, kind::bitmap};
+        }
+        clear(c);
+        c = r;
+    }
+
+    static void insert_array(container& c, uint16_t low) {
+        uint16_t* a = array_of(c);
+        uint32_t i = c.size;
+        // Sorted input always appends, which needs no search.
+        if (c.size > 0 && a[c.size - 1] >= low) {
+            i = lower_bound_index(a, c.size, low);
+            if (a[i] == low) return;
+        }
+        if (c.size == array_max) [[unlikely]] {
+            convert_array(c);
+            insert_into(c, low);
+            return;
+        }
+        if (c.size == c.cap) {
+            uint32_t cap = std::min<uint32_t>(array_max, c.cap * 2);
+            c.data = grow(c.data, cap * sizeof(uint16_t));
+            c.cap = cap;
+            a = array_of(c);
+        }
+        std::memmove(a + i + 1, a + i, (c.size - i) * sizeof(uint16_t));
+        a[i] = low;
+        ++c.size;
+    }
+
+    static void insert_bitmap(container& c, uint16_t low) {
+        uint64_t* b = bitmap_of(c);
+        uint64_t bit = uint64_t(1) << (low % 64);
+        c.size += (b[low / 64] & bit) == 0;
+        b[low / 64] |= bit;
+        if (c.size == buckets) [[unlikely]] {
+            // A full bucket is a single range.
+            std::free(c.data);
+            range* r = static_cast<range*>(grow(nullptr, 4 * sizeof(range)));
+            r[0] = {0, uint16_t(buckets - 1)};
+            c = {r, 1, 4, kind::run};
+        }
+    }
+
+    static void insert_run(container& c, uint16_t low) {
+        range* r = runs_of(c);
+        uint32_t i = run_index(c, low);
+        if (i > 0 && r[i - 1].last >= low) return;
+        bool join_prev = i > 0 && uint32_t(r[i - 1].last) + 1 == low;
+        bool join_next = i < c.size && uint32_t(low) + 1 == r[i].start;
+        if (join_prev && join_next) {
+            r[i - 1].last = r[i].last;
+            std::memmove(r + i, r + i + 1, (c.size - i - 1) * sizeof(range));
+            --c.size;
+        } else if (join_prev) {
+            r[i - 1].last = low;
+        } else if (join_next) {
+            r[i].start = low;
+        } else {
+            if (c.size == run_max) [[unlikely]] {
+                convert_run(c);
+                insert_bitmap(c, low);
+                return;
+            }
+            if (c.size == c.cap) {
+                uint32_t cap = std::min<uint32_t>(run_max, c.cap * 2);
+                c.data = grow(c.data, cap * sizeof(range));
+                c.cap = cap;
+                r = runs_of(c);
+            }
+            std::memmove(r + i + 1, r + i, (c.size - i) * sizeof(range));
+            r[i] = {low, low};
+            ++c.size;
+        }
+    }
+
+    static void erase_array(container& c, uint16_t low) {
+        uint16_t* a = array_of(c);
+        uint32_t i = lower_bound_index(a, c.size, low);
+        if (i == c.size || a[i] != low) return;
+        std::memmove(a + i, a + i + 1, (c.size - i - 1) * sizeof(uint16_t));
+        if (--c.size == 0) clear(c);
+    }
+
+    static void erase_bitmap(container& c, uint16_t low) {
+        uint64_t* b = bitmap_of(c);
+        uint64_t bit = uint64_t(1) << (low % 64);
+        if ((b[low / 64] & bit) == 0) return;
+        b[low / 64] &= ~bit;
+        // Well below the size where arrays become bitmaps, so that erasing
+        // and inserting around it does not convert back and forth.
+        if (--c.size <= array_max / 2) [[unlikely]] {
+            from_bitmap(c, b);
+        }
+    }
+
+    static void erase_run(container& c, uint16_t low) {
+        range* r = runs_of(c);
+        uint32_t i = run_index(c, low);
+        if (i == 0 || r[i - 1].last < low) return;
+        range& x = r[i - 1];
+        if (x.start == x.last) {
+            std::memmove(r + i - 1, r + i, (c.size - i) * sizeof(range));
+            if (--c.size == 0) clear(c);
+        } else if (x.start == low) {
+            ++x.start;
+        } else if (x.last == low) {
+            --x.last;
+        } else {
+            // Splits the range in two.
+            if (c.size == run_max) [[unlikely]] {
+                convert_run(c);
+                erase_bitmap(c, low);
+                return;
+            }
+            if (c.size == c.cap) {
+                uint32_t cap = std::min<uint32_t>(run_max, c.cap * 2);
+                c.data = grow(c.data, cap * sizeof(range));
+                c.cap = cap;
+                r = runs_of(c);
+            }
+            std::memmove(r + i + 1, r + i, (c.size - i) * sizeof(range));
+            r[i] = {uint16_t(low + 1), r[i - 1].last};
+            r[i - 1].last = uint16_t(low - 1);
+            ++c.size;
+        }
+    }
+
+    /**
+     * Prefetches the memory of c that a query for low will look at first.
+     */
+    static void prefetch(const container& c, uint16_t low) {
+        if (c.k == kind::bitmap) {
+            __builtin_prefetch(bitmap_of(c) + low / 64);
+        } else if (c.k == kind::array) {
+            // The first probe of the binary search.
+            __builtin_prefetch(array_of(c) + c.size / 2);
+        }
+    }
+
+    static void insert_into(container& c, uint16_t low) {
+        switch (c.k) {
+            case kind::empty:
+                c.data = grow(nullptr, 4 * sizeof(uint16_t));
+                c.cap = 4;
+                c.k = kind::array;
+                [[fallthrough]];
+            case kind::array:
+                insert_array(c, low);
+                return;
+            case kind::bitmap:
+                insert_bitmap(c, low);
+                return;
+            case kind::run:
+                insert_run(c, low);
+                return;
+        }
+    }
+
+    static void erase_from(container& c, uint16_t low) {
+        switch (c.k) {
+            case kind::array:
+                erase_array(c, low);
+                return;
+            case kind::bitmap:
+                erase_bitmap(c, low);
+                return;
+            case kind::run:
+                erase_run(c, low);
+                return;
+            default:
+                return;
+        }
+    }
+
+    /**
+     * @return 1 if low is in c, otherwise 0.
+     */
+    static int count_in(const container& c, uint16_t low) {
+        switch (c.k) {
+            case kind::array: {
+                const uint16_t* a = array_of(c);
+                uint32_t i = lower_bound_index(a, c.size, low);
+                return i < c.size && a[i] == low;
+            }
+            case kind::bitmap:
+                return (bitmap_of(c)[low / 64] >> (low % 64)) & 1;
+            case kind::run: {
+                uint32_t i = run_index(c, low);
+                return i > 0 && runs_of(c)[i - 1].last >= low;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Merges two array containers into a.
+     */
+    static void merge_arrays(container& a, const container& b, set_op o) {
+        uint16_t out[2 * array_max];
+        const uint16_t* x = array_of(a);
+        const uint16_t* y = array_of(b);
+        uint16_t* end;
+        if (o == set_op::unite) {
+            end = std::set_union(x, x + a.size, y, y + b.size, out);
+        } else if (o == set_op::intersect) {
+            end = std::set_intersection(x, x + a.size, y, y + b.size, out);
+        } else {
+            end = std::set_difference(x, x + a.size, y, y + b.size, out);
+        }
+        uint32_t n = uint32_t(end - out);
+        if (n == 0) {
+            clear(a);
+        } else if (n > array_max) {
+            alignas(64) uint64_t bits[bitmap_words] = {};
+            for (uint32_t i = 0; i < n; ++i) {
+                bits[out[i] / 64] |= uint64_t(1) << (out[i] % 64);
+            }
+            from_bitmap(a, bits);
+        } else {
+            if (n > a.cap) {
+                uint32_t cap = std::max<uint32_t>(a.cap, 4);
+                while (cap < n) cap *= 2;
+                cap = std::min(cap, array_max);
+                a.data = grow(a.data, cap * sizeof(uint16_t));
+                a.cap = cap;
+            }
+            std::memcpy(a.data, out, n * sizeof(uint16_t));
+            a.size = n;
+        }
+    }
+
+    /**
+     * Replaces a with its union, intersection or difference with b.
+     */
+    static void combine(container& a, const container& b, set_op o) {
+        if (b.k == kind::empty) {
+            if (o == set_op::intersect) clear(a);
+            return;
+        }
+        if (a.k == kind::empty) {
+            if (o == set_op::unite) a = copy_of(b);
+            return;
+        }
+        if (a.k == kind::array && b.k == kind::array) {
+            merge_arrays(a, b, o);
+            return;
+        }
+        if (a.k == kind::array && o != set_op::unite) {
+            // Keeps the values that are (or are not) in b, in place.
+            uint16_t* x = array_of(a);
+            bool keep = o == set_op::intersect;
+            uint32_t n = 0;
+            for (uint32_t i = 0; i < a.size; ++i) {
+                x[n] = x[i];
+                n += bool(count_in(b, x[i])) == keep;
+            }
+            a.size = n;
+            if (n == 0) clear(a);
+            return;
+        }
+        if (b.k == kind::array) {
+            const uint16_t* y = array_of(b);
+            if (o == set_op::unite) {
+                for (uint32_t i = 0; i < b.size; ++i) insert_into(a, y[i]);
+            } else if (o == set_op::subtract) {
+                for (uint32_t i = 0; i < b.size; ++i) erase_from(a, y[i]);
+            } else {
+                // The values of b that are in a, which is larger.
+                container r = copy_of(b);
+                uint16_t* x = array_of(r);
+                uint32_t n = 0;
+                for (uint32_t i = 0; i < r.size; ++i) {
+                    x[n] = x[i];
+                    n += count_in(a, x[i]);
+                }
+                r.size = n;
+                clear(a);
+                if (n == 0) {
+                    clear(r);
+                } else {
+                    a = r;
+                }
+            }
+            return;
+        }
+        // Bitmaps and runs.
+        alignas(64) uint64_t x[bitmap_words];
+        alignas(64) uint64_t y[bitmap_words];
+        to_bitmap(a, x);
+        to_bitmap(b, y);
+        if (o == set_op::unite) {
+            for (uint32_t i = 0; i < bitmap_words; ++i) x[i] |= y[i];
+        } else if (o == set_op::intersect) {
+            for (uint32_t i = 0; i < bitmap_words; ++i) x[i] &= y[i];
+        } else {
+            for (uint32_t i = 0; i < bitmap_words; ++i) x[i] &= ~y[i];
+        }
+        from_bitmap(a, x);
+    }
+};
+
+}  // namespace detail
+
+/**
+ * @tparam dtype Type of integer this set stores. Values must fit in 32 bits.
+ */
+template <class dtype>
+class roaring : private detail::roaring_containers {
+   private:
+    container* dir_;
+
+    /**
+     * Prefetches the container memory a query for value will look at first.
+     */
+    void prefetch_container(dtype value) const {
+        uint32_t v = value;
+        prefetch(dir_[v >> 16], uint16_t(v));
+    }
+
+   public:
+    roaring() {
+        dir_ = static_cast<container*>(
+            page_alloc(buckets * sizeof(container), false));
+    }
+
+    ~roaring() {
+        for (uint32_t i = 0; i < buckets; ++i) {
+            if (dir_[i].k != kind::empty) std::free(dir_[i].data);
+        }
+        page_free(dir_, buckets * sizeof(container));
+    }
+
+    roaring(const roaring&) = delete;
+    roaring& operator=(const roaring&) = delete;
+    roaring(roaring&&) = delete;
+    roaring& operator=(roaring&&) = delete;
+
+    /**
+     * Inserts value. Duplicates are ignored.
+     *
+     * @param value Element to be inserted.
+     */
+    void insert(dtype value) {
+        uint32_t v = value;
+        insert_into(dir_[v >> 16], uint16_t(v));
+    }
+
+    /**
+     * Removes value, if it is in the set.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        uint32_t v = value;
+        erase_from(dir_[v >> 16], uint16_t(v));
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint32_t v = value;
+        return count_in(dir_[v >> 16], uint16_t(v));
+    }
+
+    /**
+     * Adds the values of other. See include/set_ops.hpp.
+     */
+    void unite(const roaring& other) {
+        for (uint32_t i = 0; i < buckets; ++i) {
+            combine(dir_[i], other.dir_[i], set_op::unite);
+        }
+    }
+
+    /**
+     * Keeps only the values that are also in other.
+     */
+    void intersect(const roaring& other) {
+        for (uint32_t i = 0; i < buckets; ++i) {
+            combine(dir_[i], other.dir_[i], set_op::intersect);
+        }
+    }
+
+    /**
+     * Removes the values of other.
+     */
+    void subtract(const roaring& other) {
+        for (uint32_t i = 0; i < buckets; ++i) {
+            combine(dir_[i], other.dir_[i], set_op::subtract);
+        }
+    }
+
+    /**
+     * Stores the set in a snapshot (see include/snapshot.hpp): the
+     * directory without pointers as the first section, and the data of all
+     * containers, back to back in bucket order, as the second.
+     */
+    void save(snapshot_writer& w) const {
+        w.section();
+        stored* d = w.append_owned<stored>(buckets);
+        for (uint32_t i = 0; i < buckets; ++i) {
+            const container& c = dir_[i];
+            d[i] = {c.size, c.cap, c.k, 0};
+        }
+        w.section();
+        for (uint32_t i = 0; i < buckets; ++i) {
+            const container& c = dir_[i];
+            if (c.k != kind::empty) {
+                w.append(c.data, payload_bytes(c.size, c.k));
+            }
+        }
+    }
+
+    /**
+     * Fills the empty set from a snapshot. The containers are copied out of
+     * the mapping, since insertions may grow or free them.
+     *
+     * @return false iff the snapshot is not a valid roaring set.
+     */
+    bool load(snapshot& s) {
+        size_t dir_bytes = 0;
+        size_t data_bytes = 0;
+        const stored* d = static_cast<const stored*>(s.section(0, dir_bytes));
+        const char* p = static_cast<const char*>(s.section(1, data_bytes));
+        if (d == nullptr || p == nullptr ||
+            dir_bytes != buckets * sizeof(stored)) {
+            return false;
+        }
+        // Checked in full before anything is allocated.
+        size_t total = 0;
+        for (uint32_t i = 0; i < buckets; ++i) {
+            const stored& e = d[i];
+            bool fits = e.k == kind::empty ||
+                        (e.k == kind::array && e.size <= e.cap &&
+                         e.cap <= array_max) ||
+                        (e.k == kind::bitmap && e.size <= buckets) ||
+                        (e.k == kind::run && e.size <= e.cap &&
+                         e.cap <= run_max);
+            if (!fits) return false;
+            total += payload_bytes(e.size, e.k);
+        }
+        if (total != data_bytes) return false;
+        for (uint32_t i = 0; i < buckets; ++i) {
+            const stored& e = d[i];
+            if (e.k == kind::empty) continue;
+            size_t bytes = payload_bytes(e.size, e.k);
+            void* data;
+            if (e.k == kind::bitmap) {
+                data = new_bitmap();
+            } else {
+                size_t elem = e.k == kind::array ? sizeof(uint16_t)
+                                                 : sizeof(range);
+                data = grow(nullptr, std::max<size_t>(e.cap, 1) * elem);
+            }
+            std::memcpy(data, p, bytes);
+            p += bytes;
+            dir_[i] = {data, e.size, e.cap, e.k};
+        }
+        return true;
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp): the whole
+     *         directory and the containers.
+     */
+    size_t bytes_used() const {
+        size_t bytes = sizeof(*this) + buckets * sizeof(container);
+        for (uint32_t i = 0; i < buckets; ++i) bytes += data_bytes(dir_[i]);
+        return bytes;
+    }
+
+    /**
+     * Batched count, see batch.hpp. Prefetching happens in two stages, since
+     * the container data can only be located once the directory entry has
+     * arrived: the directory entry for the query 2 * ahead positions away,
+     * and the container data for the query ahead positions away.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 8;
+        size_t i = 0;
+        for (; i + 2 * ahead < n; ++i) {
+            __builtin_prefetch(dir_ + (uint32_t(vals[i + 2 * ahead]) >> 16));
+            prefetch_container(vals[i + ahead]);
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,273 @@
+/**
+ * Roaring style container set for 64-bit values.
+ *
+ * pfp::roaring splits the 32-bit range into 2^16 buckets and keeps a
+ * directory entry for every one of them. The 64-bit range has 2^48 buckets,
+ * so here only the buckets in use have an entry, in an open addressing hash
+ * table keyed by the high 48 bits of the values. Inside a bucket nothing
+ * changes: the low 16 bits of its values go into an array, bitmap or run
+ * container (see detail::roaring_containers in include/roaring.hpp).
+ *
+ * Values that share their high bits with others take 2 bytes each or less,
+ * a quarter of what a 64-bit hash set or sorted vector needs. IDs made of a
+ * prefix (a shard, a type, a time) and a counter have this shape. A value
+ * without neighbours takes a bucket of its own, a 24 byte entry plus the
+ * smallest array container, so uniformly spread values are better off in
+ * pfp::hash_set<int64_t>.
+ *
+ * A query costs one hash table probe, which usually touches a single cache
+ * line, and the search in one small container, the same as pfp::roaring
+ * apart from the directory. Set operations combine the containers of the
+ * buckets both sets have, like pfp::roaring does.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "roaring.hpp"
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integer this set stores. Values must be
+ *               non-negative.
+ */
+template <class dtype>
+class roaring64 : private detail::roaring_containers {
+   private:
+    // The high 48 bits of a value are never all ones.
+    static constexpr uint64_t no_bucket = ~uint64_t(0);
+    static constexpr unsigned initial_bits = 4;
+
+    /**
+     * A used bucket and its container, in one slot of the table.
+     */
+    struct entry {
+        uint64_t high;
+        container c;
+    };
+
+    entry* table_ = nullptr;
+    // log2 of the number of slots.
+    unsigned bits_ = 0;
+    size_t slots_ = 0;
+    size_t size_ = 0;
+    size_t max_size_ = 0;
+
+    size_t home(uint64_t high) const {
+        // Fibonacci hashing, like pfp::hash_set.
+        return (high * 0x9e3779b97f4a7c15ULL) >> (64 - bits_);
+    }
+
+    /**
+     * @return The slot of bucket high, or the empty slot where it would go.
+     */
+    size_t find(uint64_t high) const {
+        size_t i = home(high);
+        while (table_[i].high != high && table_[i].high != no_bucket) {
+            i = (i + 1) & (slots_ - 1);
+        }
+        return i;
+    }
+
+    /**
+     * Moves the buckets into a table of 2^bits slots. Buckets that have
+     * become empty are dropped on the way.
+     */
+    void resize(unsigned bits) {
+        entry* old = table_;
+        size_t old_slots = slots_;
+        bits_ = bits;
+        slots_ = size_t(1) << bits;
+        table_ = static_cast<entry*>(std::malloc(slots_ * sizeof(entry)));
+        if (table_ == nullptr) throw std::bad_alloc();
+        for (size_t i = 0; i < slots_; ++i) table_[i] = {no_bucket, {}};
+        // Linear probing slows down quickly beyond half full.
+        max_size_ = slots_ / 2;
+        size_ = 0;
+        for (size_t i = 0; i < old_slots; ++i) {
+            if (old[i].high != no_bucket && old[i].c.k != kind::empty) {
+                table_[find(old[i].high)] = old[i];
+                ++size_;
+            }
+        }
+        std::free(old);
+    }
+
+    /**
+     * Removes the bucket in slot i. Later buckets of the same probe
+     * sequence move up into the hole (backward shift deletion), so that
+     * lookups never need tombstones.
+     */
+    void remove_slot(size_t i) {
+        size_t mask = slots_ - 1;
+        for (size_t j = (i + 1) & mask; table_[j].high != no_bucket;
+             j = (j + 1) & mask) {
+            // Bucket j may move to i iff its home is not in (i, j].
+            size_t h = home(table_[j].high);
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                table_[i] = table_[j];
+                i = j;
+            }
+        }
+        table_[i] = {no_bucket, {}};
+        --size_;
+    }
+
+    /**
+     * Combines the buckets of this set with the same buckets of other, for
+     * intersections and differences, which only change buckets that this
+     * set already has.
+     */
+    void combine_present(const roaring64& other, set_op o) {
+        bool emptied = false;
+        for (size_t i = 0; i < slots_; ++i) {
+            entry& e = table_[i];
+            if (e.high == no_bucket) continue;
+            const entry& b = other.table_[other.find(e.high)];
+            if (b.high == no_bucket) {
+                if (o == set_op::intersect) clear(e.c);
+            } else {
+                combine(e.c, b.c, o);
+            }
+            emptied |= e.c.k == kind::empty;
+        }
+        // Removing right away would move buckets past the loop.
+        if (emptied) resize(bits_);
+    }
+
+   public:
+    roaring64() { resize(initial_bits); }
+
+    ~roaring64() {
+        for (size_t i = 0; i < slots_; ++i) {
+            if (table_[i].high != no_bucket) std::free(table_[i].c.data);
+        }
+        std::free(table_);
+    }
+
+    roaring64(const roaring64&) = delete;
+    roaring64& operator=(const roaring64&) = delete;
+    roaring64(roaring64&&) = delete;
+    roaring64& operator=(roaring64&&) = delete;
+
+    /**
+     * Inserts value. Duplicates are ignored.
+     *
+     * @param value Element to be inserted. Must not be negative.
+     */
+    void insert(dtype value) {
+        uint64_t v = value;
+        uint64_t high = v >> 16;
+        size_t i = find(high);
+        if (table_[i].high == no_bucket) [[unlikely]] {
+            if (size_ + 1 > max_size_) {
+                resize(bits_ + 1);
+                i = find(high);
+            }
+            table_[i].high = high;
+            ++size_;
+        }
+        insert_into(table_[i].c, uint16_t(v));
+    }
+
+    /**
+     * Removes value, if it is in the set, and its bucket once it is empty.
+     *
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        uint64_t v = value;
+        size_t i = find(v >> 16);
+        if (table_[i].high == no_bucket) return;
+        erase_from(table_[i].c, uint16_t(v));
+        if (table_[i].c.k == kind::empty) remove_slot(i);
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint64_t v = value;
+        const entry& e = table_[find(v >> 16)];
+        return e.high == no_bucket ? 0 : count_in(e.c, uint16_t(v));
+    }
+
+    /**
+     * Adds the values of other. See include/set_ops.hpp.
+     */
+    void unite(const roaring64& other) {
+        for (size_t j = 0; j < other.slots_; ++j) {
+            const entry& b = other.table_[j];
+            if (b.high == no_bucket) continue;
+            size_t i = find(b.high);
+            if (table_[i].high == no_bucket) {
+                if (size_ + 1 > max_size_) {
+                    resize(bits_ + 1);
+                    i = find(b.high);
+                }
+                table_[i] = {b.high, copy_of(b.c)};
+                ++size_;
+            } else {
+                combine(table_[i].c, b.c, set_op::unite);
+            }
+        }
+    }
+
+    /**
+     * Keeps only the values that are also in other.
+     */
+    void intersect(const roaring64& other) {
+        combine_present(other, set_op::intersect);
+    }
+
+    /**
+     * Removes the values of other.
+     */
+    void subtract(const roaring64& other) {
+        combine_present(other, set_op::subtract);
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp): the table,
+     *         empty slots included, and the containers.
+     */
+    size_t bytes_used() const {
+        size_t bytes = sizeof(*this) + slots_ * sizeof(entry);
+        for (size_t i = 0; i < slots_; ++i) {
+            if (table_[i].high != no_bucket) bytes += data_bytes(table_[i].c);
+        }
+        return bytes;
+    }
+
+    /**
+     * Batched count, see batch.hpp. Prefetches in two stages like
+     * pfp::roaring: the home slot of the query 2 * ahead positions away,
+     * and the container data of the query ahead positions away, whose slot
+     * has arrived by then.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 8;
+        size_t i = 0;
+        for (; i + 2 * ahead < n; ++i) {
+            __builtin_prefetch(table_ + home(uint64_t(vals[i + 2 * ahead]) >>
+                                             16));
+            uint64_t v = vals[i + ahead];
+            const entry& e = table_[find(v >> 16)];
+            if (e.high != no_bucket) prefetch(e.c, uint16_t(v));
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,111 @@
+/**
+ * Bulk set operations: union, intersection and difference.
+ *
+ * Operation streams can combine the set with a second set, given as a run of
+ * values after a -3, -4 or -5 marker (see pfp::op in include/op_stream.hpp).
+ * The second set is built as a structure of the same type, and structures
+ * that can combine two sets faster than value by value provide
+ *
+ *     void unite(const set_t& other)
+ *     void intersect(const set_t& other)
+ *     void subtract(const set_t& other)
+ *
+ * which work word by word for the bit vectors, by merging for pfp::vs and
+ * container by container for pfp::roaring. pfp::apply_set_op calls them if
+ * they exist. For the other structures the values of the second set are
+ * inserted or erased one by one instead, and an intersection visits the
+ * elements of the set with
+ *
+ *     template <class F> void for_each(F f) const
+ *
+ * (or begin and end, for the standard library containers) and erases the
+ * ones that are not in the second set.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "op_stream.hpp"
+#include "parallel.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+template <class qs_t, class = void>
+struct has_set_ops : std::false_type {};
+
+template <class qs_t>
+struct has_set_ops<qs_t, decltype(void(std::declval<qs_t&>().intersect(
+                             std::declval<const qs_t&>())))>
+    : std::true_type {};
+
+template <class qs_t, class dtype, class = void>
+struct has_for_each : std::false_type {};
+
+template <class qs_t, class dtype>
+struct has_for_each<qs_t, dtype,
+                    decltype(void(std::declval<const qs_t&>().for_each(
+                        std::declval<void (*)(dtype)>())))>
+    : std::true_type {};
+
+}  // namespace detail
+
+/**
+ * Replaces qs with its union, intersection or difference with the set of
+ * values v[0, n).
+ *
+ * @param o     op::unite, op::intersect or op::subtract.
+ * @param limit Highest value, for structures whose constructor takes it
+ *              (like pfp::bv), to build the second set with.
+ */
+template <class query_structure, class dtype>
+void apply_set_op(query_structure& qs, op o, const dtype* v, size_t n,
+                  uint64_t limit) {
+    if constexpr (detail::has_set_ops<query_structure>::value) {
+        std::unique_ptr<query_structure> other;
+        if constexpr (std::is_constructible<query_structure, dtype>::value) {
+            other.reset(new query_structure(dtype(limit)));
+        } else {
+            other.reset(new query_structure());
+        }
+        build_from(*other, v, v + n, nullptr);
+        if (o == op::unite) {
+            qs.unite(*other);
+        } else if (o == op::intersect) {
+            qs.intersect(*other);
+        } else {
+            qs.subtract(*other);
+        }
+    } else if (o == op::unite) {
+        for (size_t i = 0; i < n; ++i) qs.insert(v[i]);
+    } else if (o == op::subtract) {
+        for (size_t i = 0; i < n; ++i) qs.erase(v[i]);
+    } else {
+        std::vector<dtype> keep(v, v + n);
+        std::sort(keep.begin(), keep.end());
+        // Erased afterwards, since erasing while visiting would invalidate
+        // the iteration.
+        std::vector<dtype> drop;
+        auto visit = [&](dtype x) {
+            if (!std::binary_search(keep.begin(), keep.end(), x)) {
+                drop.push_back(x);
+            }
+        };
+        if constexpr (detail::has_for_each<query_structure, dtype>::value) {
+            qs.for_each(visit);
+        } else {
+            for (dtype x : qs) visit(x);
+        }
+        for (dtype x : drop) qs.erase(x);
+    }
+}
+
+}  // namespace pfp
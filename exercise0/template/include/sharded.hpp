@@ -0,0 +1,312 @@
+/**
+ * A set split by the high bits of its values into shards on NUMA nodes.
+ *
+ * pfp::sharded<set_t, dtype> wraps any of the sets and keeps one set_t per
+ * shard. Shard s holds the values v with v >> shift == s, a contiguous
+ * range, stored relative to the start of the range, so that a bit vector
+ * shard only has the bits of its own range. There are as many shards as
+ * nodes, rounded up to a power of two, and shard s belongs to node
+ * s % nodes (see include/numa.hpp for the nodes and their threads).
+ *
+ * The shards are constructed by threads on their nodes, and everything that
+ * works on whole shards runs there as well:
+ *
+ * - build_from (-s) sorts the values by shard, and every node builds its
+ *   own shards, so that all the pages they touch are local.
+ * - count_parallel (-j, see include/parallel.hpp) sorts a batch of queries
+ *   by shard, and the threads of every node answer the queries of its own
+ *   shards. The results are put back into the order of the queries.
+ * - freeze and the set operations go shard by shard on the nodes.
+ *
+ * Single insertions, erasures and queries go straight to their shard from
+ * the calling thread. Pages that such an insertion touches first are
+ * placed by the calling thread, so shards that should be local are best
+ * built at once. With one node there is one shard, and batches are passed
+ * on to it as they are.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "batch.hpp"
+#include "mem_usage.hpp"
+#include "numa.hpp"
+#include "parallel.hpp"
+#include "set_ops.hpp"
+
+namespace pfp {
+
+/**
+ * @tparam set_t   The set of every shard.
+ * @tparam dtype   Type of integer this set stores. Values must be
+ *                 non-negative.
+ * @tparam limited True iff the constructor of set_t takes the limit, like
+ *                 for pfp::set_type. Shards get the limit of their range.
+ */
+template <class set_t, class dtype, bool limited = false>
+class sharded {
+   private:
+    // Batches smaller than this are answered on the calling thread.
+    static constexpr size_t parallel_min = size_t(1) << 14;
+
+    node_threads threads_;
+    // Value v belongs to shard v >> shift_.
+    unsigned shift_ = 0;
+    std::vector<std::unique_ptr<set_t>> shards_;
+    // Scratch space for batches sorted by shard: the values relative to
+    // their shard, shard after shard, where they came from in the batch,
+    // and where the values of every shard start.
+    std::vector<dtype> local_;
+    std::vector<size_t> pos_;
+    std::vector<size_t> start_;
+    std::vector<uint8_t> results_;
+
+    size_t shard_of(dtype value) const { return uint64_t(value) >> shift_; }
+
+    dtype base(size_t s) const { return dtype(uint64_t(s) << shift_); }
+
+    /**
+     * Sorts vals[0, n) into local_ by shard, with a counting sort that
+     * keeps the order within every shard.
+     *
+     * @param positions Also record the positions in pos_.
+     */
+    void split(const dtype* vals, size_t n, bool positions) {
+        size_t shards = shards_.size();
+        start_.assign(shards + 1, 0);
+        for (size_t i = 0; i < n; ++i) ++start_[shard_of(vals[i]) + 1];
+        for (size_t s = 0; s < shards; ++s) start_[s + 1] += start_[s];
+        std::vector<size_t> next(start_.begin(), start_.end() - 1);
+        local_.resize(n);
+        if (positions) pos_.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            size_t s = shard_of(vals[i]);
+            size_t j = next[s]++;
+            local_[j] = vals[i] - base(s);
+            if (positions) pos_[j] = i;
+        }
+    }
+
+    /**
+     * Calls f(s) for every shard s, on the first thread of its node.
+     */
+    template <class F>
+    void on_nodes(F f) {
+        size_t nodes = threads_.nodes();
+        threads_.run([&](size_t node, unsigned k, unsigned) {
+            if (k != 0) return;
+            for (size_t s = node; s < shards_.size(); s += nodes) f(s);
+        });
+    }
+
+   public:
+    /**
+     * Constructs the shards on their nodes.
+     *
+     * @param limit Highest value that will be inserted or queried.
+     * @param nodes Nodes to spread the shards over, usually all of them.
+     */
+    explicit sharded(dtype limit, std::vector<numa_node> nodes = numa_nodes())
+        : threads_(std::move(nodes)) {
+        uint64_t l = limit;
+        unsigned bits = 64 - __builtin_clzll(l | 1);
+        unsigned shard_bits = 0;
+        while ((size_t(1) << shard_bits) < threads_.nodes()) ++shard_bits;
+        shift_ = bits > shard_bits ? bits - shard_bits : 0;
+        shards_.resize((l >> shift_) + 1);
+        uint64_t range = (uint64_t(1) << shift_) - 1;
+        on_nodes([&](size_t s) {
+            if constexpr (limited) {
+                uint64_t top = std::min(l - uint64_t(base(s)), range);
+                shards_[s].reset(new set_t(dtype(top)));
+            } else {
+                shards_[s].reset(new set_t());
+            }
+        });
+    }
+
+    sharded(const sharded&) = delete;
+    sharded& operator=(const sharded&) = delete;
+    sharded(sharded&&) = delete;
+    sharded& operator=(sharded&&) = delete;
+
+    /**
+     * @return Number of shards.
+     */
+    size_t shards() const { return shards_.size(); }
+
+    /**
+     * @param value Element to be inserted.
+     */
+    void insert(dtype value) {
+        size_t s = shard_of(value);
+        shards_[s]->insert(value - base(s));
+    }
+
+    /**
+     * @param value Element to be removed.
+     */
+    void erase(dtype value) {
+        size_t s = shard_of(value);
+        shards_[s]->erase(value - base(s));
+    }
+
+    /**
+     * @param value The value to count the occurrences of.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) {
+        size_t s = shard_of(value);
+        return shards_[s]->count(value - base(s));
+    }
+
+    /**
+     * Inserts all of [begin, end), every node building its own shards. See
+     * pfp::build_from.
+     */
+    void build_from(const dtype* begin, const dtype* end, thread_pool*) {
+        size_t n = end - begin;
+        const dtype* v = begin;
+        if (shards_.size() > 1) {
+            split(begin, n, false);
+            v = local_.data();
+        } else {
+            start_ = {0, n};
+        }
+        on_nodes([&](size_t s) {
+            pfp::build_from(*shards_[s], v + start_[s], v + start_[s + 1],
+                            nullptr);
+        });
+        // The copy can be as large as the set.
+        std::vector<dtype>().swap(local_);
+    }
+
+    /**
+     * Makes the shards read only until the next insertion, see
+     * pfp::freeze.
+     */
+    void freeze() {
+        if constexpr (detail::has_freeze<set_t>::value) {
+            on_nodes([&](size_t s) { shards_[s]->freeze(); });
+        }
+    }
+
+    /**
+     * @return Bytes the shards and the scratch space take (see
+     *         include/mem_usage.hpp). The stacks of the node threads are
+     *         not counted.
+     */
+    size_t bytes_used() const {
+        size_t bytes = sizeof(*this) + detail::heap_bytes(shards_) +
+                       detail::heap_bytes(local_) + detail::heap_bytes(pos_) +
+                       detail::heap_bytes(start_) +
+                       detail::heap_bytes(results_);
+        for (const auto& s : shards_) bytes += pfp::bytes_used(*s);
+        return bytes;
+    }
+
+    /**
+     * Batched count, see batch.hpp. The queries are sorted by shard, so
+     * that every shard still gets a whole batch.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) {
+        if (shards_.size() == 1) {
+            pfp::count_batch(*shards_[0], vals, n, out);
+            return;
+        }
+        split(vals, n, true);
+        results_.resize(n);
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            pfp::count_batch(*shards_[s], local_.data() + start_[s],
+                             start_[s + 1] - start_[s],
+                             results_.data() + start_[s]);
+        }
+        for (size_t j = 0; j < n; ++j) out[pos_[j]] = results_[j];
+    }
+
+    /**
+     * Answers n queries with the threads of all nodes, each node answering
+     * the queries of its own shards. Takes the place of the threads of
+     * pool, which may run on any node.
+     */
+    void count_parallel(thread_pool&, const dtype* vals, size_t n,
+                        uint8_t* out) {
+        if (n < parallel_min) {
+            count_batch(vals, n, out);
+            return;
+        }
+        freeze();
+        const dtype* v = vals;
+        uint8_t* res = out;
+        if (shards_.size() > 1) {
+            split(vals, n, true);
+            results_.resize(n);
+            v = local_.data();
+            res = results_.data();
+        } else {
+            start_ = {0, n};
+        }
+        size_t nodes = threads_.nodes();
+        threads_.run([&](size_t node, unsigned k, unsigned m) {
+            for (size_t s = node; s < shards_.size(); s += nodes) {
+                size_t len = start_[s + 1] - start_[s];
+                size_t lo = start_[s] + len * k / m;
+                size_t hi = start_[s] + len * (k + 1) / m;
+                if (lo < hi) {
+                    pfp::count_batch(*shards_[s], v + lo, hi - lo, res + lo);
+                }
+            }
+        });
+        if (shards_.size() > 1) {
+            for (size_t j = 0; j < n; ++j) out[pos_[j]] = results_[j];
+        }
+    }
+
+    /**
+     * Set operations shard by shard, for sets that have them (see
+     * include/set_ops.hpp). other must have the same limit and nodes.
+     */
+    template <class S = set_t>
+    auto unite(const sharded& other)
+        -> decltype(std::declval<S&>().unite(std::declval<const S&>())) {
+        on_nodes([&](size_t s) { shards_[s]->unite(*other.shards_[s]); });
+    }
+
+    template <class S = set_t>
+    auto intersect(const sharded& other)
+        -> decltype(std::declval<S&>().intersect(std::declval<const S&>())) {
+        on_nodes([&](size_t s) { shards_[s]->intersect(*other.shards_[s]); });
+    }
+
+    template <class S = set_t>
+    auto subtract(const sharded& other)
+        -> decltype(std::declval<S&>().subtract(std::declval<const S&>())) {
+        on_nodes([&](size_t s) { shards_[s]->subtract(*other.shards_[s]); });
+    }
+
+    /**
+     * Calls f(value) for every value, shard by shard. Shards without
+     * for_each are iterated, like the standard library containers in
+     * pfp::apply_set_op.
+     */
+    template <class F>
+    void for_each(F f) const {
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            dtype b = base(s);
+            auto visit = [&](dtype x) { f(dtype(x + b)); };
+            if constexpr (detail::has_for_each<set_t, dtype>::value) {
+                shards_[s]->for_each(visit);
+            } else {
+                for (dtype x : *shards_[s]) visit(x);
+            }
+        }
+    }
+};
+
+}  // namespace pfp
@@ -0,0 +1,287 @@
+/**
+ * Snapshots of built data structures (--save and --load of query.cpp).
+ *
+ * Workloads that run many query streams against the same insertions rebuild
+ * the same structure every time. A snapshot stores the built structure as a
+ * few flat arrays without pointers, so that loading it is a matter of
+ * mapping the file: a bit vector is used straight from the mapping, and the
+ * kernel only reads the pages that queries touch.
+ *
+ * The file is a header page followed by the arrays (sections), each starting
+ * at a page boundary so that it can be used in place:
+ *
+ * word 0           magic  "pfpsnap1" as a little endian uint64.
+ * word 1           type   Number of the type (-t) that was saved.
+ * word 2           limit  Limit the structure was created with.
+ * word 3           s      Number of sections, at most max_sections.
+ * words 4..4+2s           Offset and size in bytes of every section.
+ *
+ * What the sections contain is up to the structure. Structures that support
+ * snapshots have two members:
+ *
+ *     void save(pfp::snapshot_writer& w)
+ *     bool load(pfp::snapshot& s)
+ *
+ * load is called on a freshly constructed structure and returns false iff
+ * the sections do not fit it.
+ *
+ * The mapping is private and writable (copy-on-write): pages stay shared with
+ * the page cache, but a structure that gets insertions after loading can
+ * still change them, without changing the file.
+ *
+ * A structure loaded from a file can be saved to that same file (--load F
+ * --save F). Its pages that were not changed are still those of the file,
+ * so the new snapshot is written next to it and then renamed over it. The
+ * old file stays mapped until the structure is gone.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "op_stream.hpp"
+
+namespace pfp {
+
+namespace detail {
+
+constexpr uint64_t snapshot_magic = 0x3170616e73706670ULL;  // "pfpsnap1"
+constexpr size_t snapshot_page = 4096;
+constexpr size_t max_sections = 4;
+constexpr size_t snapshot_header_words = 4 + 2 * max_sections;
+
+}  // namespace detail
+
+/**
+ * Collects the sections of a snapshot and writes the file.
+ */
+class snapshot_writer {
+   private:
+    struct piece {
+        const void* data;
+        size_t bytes;
+    };
+
+    std::vector<std::vector<piece>> sections_;
+    std::vector<std::unique_ptr<char[]>> owned_;
+
+   public:
+    /**
+     * Starts the next section.
+     */
+    void section() { sections_.emplace_back(); }
+
+    /**
+     * Appends bytes to the current section. The data is only copied by
+     * write, so it has to stay valid until then.
+     */
+    void append(const void* data, size_t bytes) {
+        sections_.back().push_back({data, bytes});
+    }
+
+    /**
+     * Appends n zeroed objects, owned by the writer, to the current section.
+     *
+     * @return Pointer to the objects, to be filled in before write.
+     */
+    template <class T>
+    T* append_owned(size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "snapshots are copied byte by byte");
+        owned_.emplace_back(new char[n * sizeof(T)]());
+        append(owned_.back().get(), n * sizeof(T));
+        return reinterpret_cast<T*>(owned_.back().get());
+    }
+
+    /**
+     * Writes the snapshot file, to path.tmp first, which then replaces path.
+     * A snapshot at path is left as it is if anything fails.
+     *
+     * @param type  Number of the type of the structure.
+     * @param limit Limit the structure was created with.
+     * @return false iff the file could not be written.
+     */
+    bool write(const char* path, int type, uint64_t limit) const {
+        if (sections_.size() > detail::max_sections) return false;
+        uint64_t header[detail::snapshot_header_words] = {
+            detail::snapshot_magic, uint64_t(type), limit, sections_.size()};
+        uint64_t offset = detail::snapshot_page;
+        for (size_t i = 0; i < sections_.size(); ++i) {
+            uint64_t bytes = 0;
+            for (const piece& p : sections_[i]) bytes += p.bytes;
+            header[4 + 2 * i] = offset;
+            header[5 + 2 * i] = bytes;
+            offset += (bytes + detail::snapshot_page - 1) /
+                      detail::snapshot_page * detail::snapshot_page;
+        }
+        std::string tmp = std::string(path) + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        static const char zeros[detail::snapshot_page] = {};
+        bool ok = detail::write_all(fd, header, sizeof(header)) &&
+                  detail::write_all(fd, zeros,
+                                    detail::snapshot_page - sizeof(header));
+        for (size_t i = 0; ok && i < sections_.size(); ++i) {
+            for (const piece& p : sections_[i]) {
+                ok = ok && detail::write_all(fd, p.data, p.bytes);
+            }
+            size_t pad = header[5 + 2 * i] % detail::snapshot_page;
+            if (ok && pad != 0) {
+                ok = detail::write_all(fd, zeros, detail::snapshot_page - pad);
+            }
+        }
+        // On disk before it replaces the old snapshot.
+        ok = ok && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        ok = ok && std::rename(tmp.c_str(), path) == 0;
+        if (!ok) unlink(tmp.c_str());
+        return ok;
+    }
+};
+
+/**
+ * A mapped snapshot file. Has to outlive the structure that loads it.
+ */
+class snapshot {
+   private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+    const uint64_t* header_ = nullptr;
+    bool ok_ = false;
+
+   public:
+    /**
+     * Maps the snapshot at path and checks its header.
+     */
+    explicit snapshot(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            size_t(st.st_size) >= detail::snapshot_page) {
+            size_ = st.st_size;
+            void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) data_ = static_cast<char*>(p);
+        }
+        close(fd);
+        if (data_ == nullptr) return;
+        header_ = reinterpret_cast<const uint64_t*>(data_);
+        if (header_[0] != detail::snapshot_magic ||
+            header_[3] > detail::max_sections) {
+            return;
+        }
+        for (size_t i = 0; i < header_[3]; ++i) {
+            uint64_t offset = header_[4 + 2 * i];
+            uint64_t bytes = header_[5 + 2 * i];
+            if (offset % detail::snapshot_page != 0 || offset > size_ ||
+                bytes > size_ - offset) {
+                return;
+            }
+        }
+        ok_ = true;
+    }
+
+    ~snapshot() {
+        if (data_ != nullptr) munmap(data_, size_);
+    }
+
+    snapshot(const snapshot&) = delete;
+    snapshot& operator=(const snapshot&) = delete;
+    snapshot(snapshot&&) = delete;
+    snapshot& operator=(snapshot&&) = delete;
+
+    /**
+     * @return false iff the file could not be mapped or is not a snapshot.
+     */
+    bool ok() const { return ok_; }
+
+    int type() const { return int(header_[1]); }
+
+    uint64_t limit() const { return header_[2]; }
+
+    size_t sections() const { return header_[3]; }
+
+    /**
+     * Section i, page aligned.
+     *
+     * @param bytes Output for the size of the section.
+     * @return nullptr if there is no section i.
+     */
+    void* section(size_t i, size_t& bytes) {
+        if (i >= sections()) return nullptr;
+        bytes = header_[5 + 2 * i];
+        return data_ + header_[4 + 2 * i];
+    }
+};
+
+namespace detail {
+
+template <class qs_t, class = void>
+struct has_snapshot : std::false_type {};
+
+template <class qs_t>
+struct has_snapshot<
+    qs_t, decltype(void(std::declval<qs_t&>().save(
+                       std::declval<snapshot_writer&>())),
+                   void(std::declval<qs_t&>().load(
+                       std::declval<snapshot&>())))> : std::true_type {};
+
+}  // namespace detail
+
+/**
+ * @return True iff query_structure can be saved and loaded.
+ */
+template <class query_structure>
+constexpr bool supports_snapshot() {
+    return detail::has_snapshot<query_structure>::value;
+}
+
+/**
+ * Saves qs to the file at path.
+ *
+ * @param type  Number of the type of qs.
+ * @param limit Limit qs was created with.
+ * @return false iff qs does not support snapshots or writing failed.
+ */
+template <class query_structure>
+bool save_snapshot(query_structure& qs, const char* path, int type,
+                   uint64_t limit) {
+    if constexpr (supports_snapshot<query_structure>()) {
+        snapshot_writer w;
+        qs.save(w);
+        return w.write(path, type, limit);
+    } else {
+        return false;
+    }
+}
+
+/**
+ * Loads a snapshot into the freshly constructed qs.
+ *
+ * @return false iff qs does not support snapshots or the snapshot does not
+ *         fit it.
+ */
+template <class query_structure>
+bool load_snapshot(query_structure& qs, snapshot& s) {
+    if constexpr (supports_snapshot<query_structure>()) {
+        return qs.load(s);
+    } else {
+        return false;
+    }
+}
+
+}  // namespace pfp
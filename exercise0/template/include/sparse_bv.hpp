@@ -0,0 +1,362 @@
+/**
+ * Two level bit vector set.
+ *
+ * pfp::bv needs one bit for every value up to the limit, 256 MiB for the
+ * default limit of 2^31 - 1, even if all values are small. Here the bits are
+ * split into leaves of 2^16 bits (8 KiB, the same split as the buckets of
+ * pfp::roaring), and a directory holds one pointer per leaf:
+ *
+ * - Leaves are only allocated once a value is inserted into them, so memory
+ *   grows with the range that is actually occupied. The directory itself is
+ *   8 bytes per 2^16 values, 256 KiB for the default limit.
+ * - Directory entries of empty leaves point to one shared leaf of zeros, and
+ *   entries of full leaves to one shared leaf of ones (the leaf that became
+ *   full is freed). A query therefore never has to check for missing leaves:
+ *   it loads the directory entry and then the word, two dependent loads and
+ *   no branches, just like the one load of pfp::bv.
+ *
+ * Insertions check for the two shared leaves and keep a count of set bits
+ * per leaf, to notice when one becomes full. Erasures likewise return leaves
+ * that become empty, and give a full leaf its own copy again. Leaves are cut
+ * from 2 MiB slabs of page_alloc memory, which come zeroed and backed by huge
+ * pages, instead of taking two page faults per 8 KiB leaf from malloc.
+ *
+ * Union, intersection and difference with another sparse bit vector go leaf
+ * by leaf: leaves that are empty or full on either side are decided without
+ * looking at their words, the others are combined word by word.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "mem_usage.hpp"
+#include "page_alloc.hpp"
+#include "snapshot.hpp"
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integer this set stores. Values must be
+ *               non-negative.
+ */
+template <class dtype>
+class sparse_bv {
+   private:
+    static constexpr unsigned leaf_bits = 16;
+    static constexpr uint32_t leaf_values = uint32_t(1) << leaf_bits;
+    static constexpr size_t leaf_words = leaf_values / 64;
+    static constexpr size_t slab_bytes = huge_page_size;
+
+    struct leaf {
+        alignas(64) uint64_t words[leaf_words];
+    };
+
+    /**
+     * The leaf of ones. Filled in once at startup and never written after
+     * that.
+     */
+    struct full_leaf {
+        leaf l;
+        full_leaf() {
+            for (uint64_t& w : l.words) w = ~uint64_t(0);
+        }
+    };
+
+    static inline leaf empty_{};
+    static inline full_leaf full_{};
+
+    leaf** dir_;
+    // Number of set bits of every leaf.
+    uint32_t* counts_;
+    size_t leaves_;
+    std::vector<leaf*> slabs_;
+    // Unused part of the last slab.
+    leaf* next_ = nullptr;
+    leaf* slab_end_ = nullptr;
+    // Leaves that became full, for reuse.
+    std::vector<leaf*> free_;
+
+    bool shared(const leaf* l) const { return l == &empty_ || l == &full_.l; }
+
+    /**
+     * Sets leaf i to the shared empty or full leaf, returning its own leaf
+     * (if it has one) for reuse.
+     */
+    void share(size_t i, bool full) {
+        if (!shared(dir_[i])) free_.push_back(dir_[i]);
+        dir_[i] = full ? &full_.l : &empty_;
+        counts_[i] = full ? leaf_values : 0;
+    }
+
+    /**
+     * Gives leaf i its own copy of the words of l.
+     */
+    void copy_leaf(size_t i, const leaf* l, uint32_t count) {
+        if (shared(dir_[i])) dir_[i] = new_leaf();
+        std::memcpy(dir_[i], l, sizeof(leaf));
+        counts_[i] = count;
+    }
+
+    /**
+     * Sets every word of leaf i to f(word, word of l) and fixes its count.
+     * The leaf must have words of its own.
+     */
+    template <class F>
+    void combine_leaf(size_t i, const leaf* l, F f) {
+        uint64_t* a = dir_[i]->words;
+        uint32_t n = 0;
+        for (size_t w = 0; w < leaf_words; ++w) {
+            a[w] = f(a[w], l->words[w]);
+            n += __builtin_popcountll(a[w]);
+        }
+        if (n == 0 || n == leaf_values) {
+            share(i, n != 0);
+        } else {
+            counts_[i] = n;
+        }
+    }
+
+    leaf* new_leaf() {
+        if (!free_.empty()) {
+            leaf* l = free_.back();
+            free_.pop_back();
+            std::memset(l, 0, sizeof(leaf));
+            return l;
+        }
+        if (next_ == slab_end_) {
+            next_ = static_cast<leaf*>(page_alloc(slab_bytes, false));
+            slab_end_ = next_ + slab_bytes / sizeof(leaf);
+            slabs_.push_back(next_);
+        }
+        return next_++;
+    }
+
+   public:
+    /**
+     * @param limit Highest value that will be inserted or queried.
+     */
+    sparse_bv(dtype limit) : leaves_((uint64_t(limit) >> leaf_bits) + 1) {
+        dir_ = static_cast<leaf**>(
+            page_alloc(leaves_ * sizeof(leaf*), false));
+        counts_ = static_cast<uint32_t*>(
+            page_alloc(leaves_ * sizeof(uint32_t), false));
+        for (size_t i = 0; i < leaves_; ++i) dir_[i] = &empty_;
+    }
+
+    ~sparse_bv() {
+        for (leaf* s : slabs_) page_free(s, slab_bytes);
+        page_free(dir_, leaves_ * sizeof(leaf*));
+        page_free(counts_, leaves_ * sizeof(uint32_t));
+    }
+
+    sparse_bv(const sparse_bv&) = delete;
+    sparse_bv& operator=(const sparse_bv&) = delete;
+    sparse_bv(sparse_bv&&) = delete;
+    sparse_bv& operator=(sparse_bv&&) = delete;
+
+    /**
+     * Sets the bit for value, allocating its leaf if this is the first
+     * value in it.
+     *
+     * @param value Element to be inserted, at most the limit.
+     */
+    void insert(dtype value) {
+        uint64_t v = value;
+        size_t i = v >> leaf_bits;
+        leaf* l = dir_[i];
+        if (l == &empty_) [[unlikely]] {
+            l = dir_[i] = new_leaf();
+        } else if (l == &full_.l) [[unlikely]] {
+            return;
+        }
+        uint64_t& w = l->words[(v / 64) % leaf_words];
+        uint64_t bit = uint64_t(1) << (v % 64);
+        if (w & bit) return;
+        w |= bit;
+        if (++counts_[i] == leaf_values) [[unlikely]] {
+            free_.push_back(l);
+            dir_[i] = &full_.l;
+        }
+    }
+
+    /**
+     * Clears the bit for value. A full leaf gets its own copy of ones
+     * first, and a leaf that becomes empty is returned for reuse.
+     *
+     * @param value Element to be removed, at most the limit.
+     */
+    void erase(dtype value) {
+        uint64_t v = value;
+        size_t i = v >> leaf_bits;
+        leaf* l = dir_[i];
+        if (l == &empty_) [[unlikely]] {
+            return;
+        } else if (l == &full_.l) [[unlikely]] {
+            l = dir_[i] = new_leaf();
+            std::memset(l, 0xff, sizeof(leaf));
+        }
+        uint64_t& w = l->words[(v / 64) % leaf_words];
+        uint64_t bit = uint64_t(1) << (v % 64);
+        if (!(w & bit)) return;
+        w &= ~bit;
+        if (--counts_[i] == 0) [[unlikely]] {
+            share(i, false);
+        }
+    }
+
+    /**
+     * @param value The value to count the occurrences of, at most the limit.
+     * @return 1 if value is in the set, otherwise 0.
+     */
+    int count(dtype value) const {
+        uint64_t v = value;
+        const leaf* l = dir_[v >> leaf_bits];
+        return (l->words[(v / 64) % leaf_words] >> (v % 64)) & 1;
+    }
+
+    /**
+     * Adds the values of other, a sparse bit vector with the same limit.
+     * See include/set_ops.hpp.
+     */
+    void unite(const sparse_bv& other) {
+        for (size_t i = 0; i < leaves_; ++i) {
+            const leaf* b = other.dir_[i];
+            if (b == &empty_ || dir_[i] == &full_.l) continue;
+            if (b == &full_.l) {
+                share(i, true);
+            } else if (dir_[i] == &empty_) {
+                copy_leaf(i, b, other.counts_[i]);
+            } else {
+                combine_leaf(i, b,
+                             [](uint64_t x, uint64_t y) { return x | y; });
+            }
+        }
+    }
+
+    /**
+     * Keeps only the values that are also in other, a sparse bit vector
+     * with the same limit.
+     */
+    void intersect(const sparse_bv& other) {
+        for (size_t i = 0; i < leaves_; ++i) {
+            const leaf* b = other.dir_[i];
+            if (dir_[i] == &empty_ || b == &full_.l) continue;
+            if (b == &empty_) {
+                share(i, false);
+            } else if (dir_[i] == &full_.l) {
+                copy_leaf(i, b, other.counts_[i]);
+            } else {
+                combine_leaf(i, b,
+                             [](uint64_t x, uint64_t y) { return x & y; });
+            }
+        }
+    }
+
+    /**
+     * Removes the values of other, a sparse bit vector with the same limit.
+     */
+    void subtract(const sparse_bv& other) {
+        for (size_t i = 0; i < leaves_; ++i) {
+            const leaf* b = other.dir_[i];
+            if (dir_[i] == &empty_ || b == &empty_) continue;
+            if (b == &full_.l) {
+                share(i, false);
+                continue;
+            }
+            if (dir_[i] == &full_.l) {
+                dir_[i] = new_leaf();
+                std::memset(dir_[i], 0xff, sizeof(leaf));
+            }
+            combine_leaf(i, b, [](uint64_t x, uint64_t y) { return x & ~y; });
+        }
+    }
+
+    /**
+     * Stores the set in a snapshot (see include/snapshot.hpp): the counts of
+     * set bits as the first section, from which the empty and full leaves
+     * follow, and the other leaves, back to back in order, as the second.
+     */
+    void save(snapshot_writer& w) const {
+        w.section();
+        w.append(counts_, leaves_ * sizeof(uint32_t));
+        w.section();
+        for (size_t i = 0; i < leaves_; ++i) {
+            if (counts_[i] != 0 && counts_[i] != leaf_values) {
+                w.append(dir_[i], sizeof(leaf));
+            }
+        }
+    }
+
+    /**
+     * Fills the empty set from a snapshot. The leaves are used in place,
+     * only the counts are copied.
+     *
+     * @return false iff the snapshot is for a different limit or not valid.
+     */
+    bool load(snapshot& s) {
+        size_t count_bytes = 0;
+        size_t leaf_bytes = 0;
+        const uint32_t* c =
+            static_cast<const uint32_t*>(s.section(0, count_bytes));
+        leaf* l = static_cast<leaf*>(s.section(1, leaf_bytes));
+        if (c == nullptr || l == nullptr ||
+            count_bytes != leaves_ * sizeof(uint32_t)) {
+            return false;
+        }
+        size_t partial = 0;
+        for (size_t i = 0; i < leaves_; ++i) {
+            if (c[i] > leaf_values) return false;
+            partial += c[i] != 0 && c[i] != leaf_values;
+        }
+        if (leaf_bytes != partial * sizeof(leaf)) return false;
+        std::memcpy(counts_, c, count_bytes);
+        for (size_t i = 0; i < leaves_; ++i) {
+            if (c[i] == 0) {
+                dir_[i] = &empty_;
+            } else if (c[i] == leaf_values) {
+                dir_[i] = &full_.l;
+            } else {
+                dir_[i] = l++;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp): the
+     *         directory, the counts and all slabs of leaves, including
+     *         the leaves in them that are not used yet. The shared empty and
+     *         full leaves are not counted.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + leaves_ * (sizeof(leaf*) + sizeof(uint32_t)) +
+               slabs_.size() * slab_bytes + detail::heap_bytes(slabs_) +
+               detail::heap_bytes(free_);
+    }
+
+    /**
+     * Batched count, see batch.hpp. The directory is small enough to stay
+     * in the caches, so only the words of the leaves are prefetched.
+     *
+     * @param vals Values to look up, at most the limit.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) const {
+        constexpr size_t ahead = 16;
+        size_t i = 0;
+        for (; i + ahead < n; ++i) {
+            uint64_t v = vals[i + ahead];
+            __builtin_prefetch(dir_[v >> leaf_bits]->words +
+                               (v / 64) % leaf_words);
+            out[i] = count(vals[i]);
+        }
+        for (; i < n; ++i) out[i] = count(vals[i]);
+    }
+};
+
+}  // namespace pfp
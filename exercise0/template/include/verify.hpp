@@ -0,0 +1,286 @@
+/**
+ * Verification of query results on a separate thread.
+ *
+ * Checking every query against a std::unordered_set right where it is
+ * answered puts a node based hash table on the critical path of every
+ * operation, which makes verified runs several times slower than normal
+ * ones. Here the operations and the results of the structure under test are
+ * only copied into blocks, and a second thread replays the blocks on its own
+ * std::unordered_set and compares the results. The thread that runs the
+ * structure only pays for the copies.
+ *
+ * A sample rate below 1 checks only a fraction of the values. The sample is
+ * taken by value (by a hash of it) rather than by position, so that every
+ * insertion of a sampled value is replayed as well and the sampled queries
+ * are still checked exactly. Both the replay cost and the memory of the
+ * reference set shrink with the rate. Erasures and set operations only
+ * change sampled values of the reference set, so they are sampled the same
+ * way.
+ *
+ * The queue between the threads holds a bounded number of blocks, so a
+ * verifier that falls far behind slows the producer down instead of
+ * buffering the whole input.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "channel.hpp"
+#include "op_stream.hpp"
+
+namespace pfp {
+
+/**
+ * @tparam dtype Type of integers in the operation stream.
+ */
+template <class dtype>
+class verifier {
+   private:
+    static constexpr size_t block_size = size_t(1) << 16;
+    // Blocks that may be waiting for the verifier thread at once.
+    static constexpr size_t max_queued = 16;
+    // Kinds of the other operations, queries store their result (0 or 1)
+    // instead. The values of a set operation come first as operands, then
+    // one entry of kind apply + (o - op::unite) with an unused value.
+    static constexpr uint8_t inserted = 2;
+    static constexpr uint8_t erased = 3;
+    static constexpr uint8_t operand = 4;
+    static constexpr uint8_t apply = 5;
+
+    /**
+     * A block of operations in stream order.
+     */
+    struct block {
+        std::vector<dtype> values;
+        std::vector<uint8_t> kinds;
+        size_t size = 0;
+
+        block() : values(block_size), kinds(block_size) {}
+    };
+
+    std::unique_ptr<block> current_;
+    channel<block> queue_;
+    // Checked blocks, for reuse. There are never more than the queued ones,
+    // the current one and the one being checked.
+    channel<block> free_;
+    std::atomic<bool> failed_{false};
+    dtype bad_value_ = 0;
+    bool bad_result_ = false;
+    uint64_t threshold_;
+    bool all_;
+    std::unordered_set<dtype> us_;
+    // The second set of the set operation being replayed.
+    std::unordered_set<dtype> operand_;
+    std::thread thread_;
+
+    bool sampled(dtype value) const {
+        if (all_) return true;
+        // Murmur3 finalizer, so that the sample does not depend on the
+        // distribution of the low bits.
+        uint64_t h = uint64_t(value);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h < threshold_;
+    }
+
+    /**
+     * Applies a set operation with operand_ to the reference set.
+     */
+    void apply_set_op(op o) {
+        if (o == op::unite) {
+            us_.insert(operand_.begin(), operand_.end());
+        } else if (o == op::subtract) {
+            for (dtype v : operand_) us_.erase(v);
+        } else {
+            for (auto it = us_.begin(); it != us_.end();) {
+                it = operand_.count(*it) ? std::next(it) : us_.erase(it);
+            }
+        }
+        operand_.clear();
+    }
+
+    /**
+     * Replays a block on the reference set.
+     *
+     * @return false iff a query result was wrong.
+     */
+    bool check(const block& b) {
+        for (size_t i = 0; i < b.size; ++i) {
+            dtype v = b.values[i];
+            uint8_t kind = b.kinds[i];
+            if (kind >= apply) {
+                apply_set_op(op(uint8_t(op::unite) + kind - apply));
+                continue;
+            }
+            if (!sampled(v)) continue;
+            if (kind == inserted) {
+                us_.insert(v);
+            } else if (kind == erased) {
+                us_.erase(v);
+            } else if (kind == operand) {
+                operand_.insert(v);
+            } else if (bool(kind) != bool(us_.count(v))) {
+                bad_value_ = v;
+                bad_result_ = kind;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void work() {
+        while (std::unique_ptr<block> b = queue_.pop()) {
+            bool ok = failed_.load(std::memory_order_relaxed) || check(*b);
+            if (!ok) failed_.store(true, std::memory_order_release);
+            b->size = 0;
+            free_.push(std::move(b));
+        }
+    }
+
+    /**
+     * Hands the current block to the verifier thread and takes an empty
+     * one, waiting if the queue is full.
+     */
+    void push() {
+        queue_.push(std::move(current_));
+        current_ = free_.try_pop();
+        if (current_ == nullptr) current_.reset(new block());
+    }
+
+    /**
+     * Appends n operations. Values go in with memcpy, split at block
+     * boundaries.
+     *
+     * @param kinds Results of queries, or nullptr for operations that all
+     *              have the kind fill.
+     */
+    void append(const dtype* values, const uint8_t* kinds, uint8_t fill,
+                size_t n) {
+        while (n > 0) {
+            block& b = *current_;
+            size_t k = std::min(n, block_size - b.size);
+            std::memcpy(b.values.data() + b.size, values, k * sizeof(dtype));
+            if (kinds != nullptr) {
+                std::memcpy(b.kinds.data() + b.size, kinds, k);
+                kinds += k;
+            } else {
+                std::memset(b.kinds.data() + b.size, fill, k);
+            }
+            b.size += k;
+            values += k;
+            n -= k;
+            if (b.size == block_size) push();
+        }
+    }
+
+   public:
+    /**
+     * Starts the verifier thread.
+     *
+     * @param rate Fraction of the values to check, in (0, 1].
+     */
+    explicit verifier(double rate)
+        : current_(new block()),
+          queue_(max_queued),
+          free_(max_queued + 2),
+          threshold_(rate < 1 ? uint64_t(rate * 18446744073709551616.0) : 0),
+          all_(rate >= 1),
+          thread_([this]() { work(); }) {}
+
+    ~verifier() { finish(); }
+
+    verifier(const verifier&) = delete;
+    verifier& operator=(const verifier&) = delete;
+    verifier(verifier&&) = delete;
+    verifier& operator=(verifier&&) = delete;
+
+    /**
+     * Records the insertion of value.
+     */
+    void insert(dtype value) {
+        block& b = *current_;
+        b.values[b.size] = value;
+        b.kinds[b.size] = inserted;
+        if (++b.size == block_size) push();
+    }
+
+    /**
+     * Records the insertions values[0, n).
+     */
+    void insert(const dtype* values, size_t n) {
+        append(values, nullptr, inserted, n);
+    }
+
+    /**
+     * Records the erasures values[0, n).
+     */
+    void erase(const dtype* values, size_t n) {
+        append(values, nullptr, erased, n);
+    }
+
+    /**
+     * Records a set operation with the second set values[0, n).
+     *
+     * @param o op::unite, op::intersect or op::subtract.
+     */
+    void set_op(op o, const dtype* values, size_t n) {
+        append(values, nullptr, operand, n);
+        dtype none = 0;
+        append(&none, nullptr, uint8_t(apply + uint8_t(o) - uint8_t(op::unite)),
+               1);
+    }
+
+    /**
+     * Records the queries values[0, n) and the results the structure gave
+     * for them.
+     */
+    void query(const dtype* values, const uint8_t* results, size_t n) {
+        append(values, results, 0, n);
+    }
+
+    /**
+     * @return false iff the verifier thread has already found a wrong
+     *         result. Cheap enough to call after every batch.
+     */
+    bool ok() const { return !failed_.load(std::memory_order_acquire); }
+
+    /**
+     * Checks all recorded operations and stops the verifier thread. Further
+     * calls do nothing.
+     *
+     * @return false iff a query result was wrong.
+     */
+    bool finish() {
+        if (thread_.joinable()) {
+            if (current_->size > 0) push();
+            queue_.close();
+            thread_.join();
+        }
+        return ok();
+    }
+
+    /**
+     * The first wrong query result. Only valid once ok() is false.
+     */
+    dtype bad_value() const { return bad_value_; }
+
+    /**
+     * What the structure answered for bad_value().
+     */
+    bool bad_result() const { return bad_result_; }
+};
+
+}  // namespace pfp
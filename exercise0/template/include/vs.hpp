@@ -1,18 +1,320 @@
 /**
- * You can use this file for programmign task 1 of set 1.
-*/
+ * Sorted vector set.
+ *
+ * Insertions are appended to the end of a contiguous buffer and only sorted
+ * into place when a query needs them. With all insertions done before any
+ * queries (the -s case) this means a single sort and deduplication of the
+ * whole buffer, and queries become binary searches over a flat array.
+ *
+ * Set operations merge the two sorted arrays in one linear pass.
+ */
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "parallel.hpp"
+#include "mem_usage.hpp"
+#include "snapshot.hpp"
+
 namespace pfp {
 
+/**
+ * @tparam dtype Type of integer this set stores.
+ */
 template <class dtype>
 class vs {
-  public:
-    void insert(dtype val) { }
+   private:
+    // Tails up to this size are searched linearly instead of being merged
+    // into the sorted prefix. Keeps interleaved workloads from re-merging the
+    // whole array after every single insertion.
+    static constexpr size_t min_tail = 256;
+
+    std::vector<dtype> data_;
+    // data_[0, sorted_) is sorted and free of duplicates. Anything after that
+    // is the tail of not yet merged insertions.
+    size_t sorted_ = 0;
+    // Largest tail that is still searched linearly.
+    size_t max_tail_ = min_tail;
+    // True iff all of data_ is in non-decreasing order. Stays true for
+    // sorted input, in which case merging the tail needs no sorting.
+    bool in_order_ = true;
+
+    /**
+     * Sorts and deduplicates the tail and merges it into the sorted prefix.
+     */
+    void merge_tail() {
+        auto mid = data_.begin() + sorted_;
+        auto from = mid;
+        if (!in_order_) {
+            std::sort(mid, data_.end());
+            // The tail only needs to be merged if it overlaps the prefix.
+            if (sorted_ > 0 && *mid < *(mid - 1)) {
+                std::inplace_merge(data_.begin(), mid, data_.end());
+                from = data_.begin();
+            }
+        }
+        // Otherwise duplicates can only be next to each other or to the last
+        // element of the sorted prefix.
+        if (from != data_.begin()) --from;
+        data_.erase(std::unique(from, data_.end()), data_.end());
+        sorted_ = data_.size();
+        in_order_ = true;
+        max_tail_ = std::max(min_tail, size_t(4 * std::sqrt(double(sorted_))));
+    }
+
+    /**
+     * Replaces the set with merge(a, a_end, b, b_end, out), where a is this
+     * set and b is other, both as sorted arrays without duplicates.
+     */
+    template <class F>
+    void merge_with(const vs& other, F merge) {
+        freeze();
+        const dtype* b = other.data_.data();
+        const dtype* b_end = b + other.sorted_;
+        std::vector<dtype> copy;
+        if (other.data_.size() > other.sorted_) {
+            // other is const and cannot merge its own tail.
+            copy = other.data_;
+            std::sort(copy.begin(), copy.end());
+            copy.erase(std::unique(copy.begin(), copy.end()), copy.end());
+            b = copy.data();
+            b_end = b + copy.size();
+        }
+        std::vector<dtype> out;
+        out.reserve(data_.size() + (b_end - b));
+        merge(data_.begin(), data_.end(), b, b_end, std::back_inserter(out));
+        data_.swap(out);
+        sorted_ = data_.size();
+        max_tail_ = std::max(min_tail, size_t(4 * std::sqrt(double(sorted_))));
+    }
+
+    /**
+     * Branchless binary search over the sorted prefix. The loop always runs
+     * log2(n) iterations with no data dependent branches, so the processor
+     * never mispredicts. Both possible next midpoints are prefetched, hiding
+     * some of the memory latency of the lower levels.
+     */
+    bool search(dtype val) const {
+        size_t len = sorted_;
+        if (len == 0) return false;
+        const dtype* base = data_.data();
+        while (len > 1) {
+            size_t half = len / 2;
+            len -= half;
+            __builtin_prefetch(base + len / 2 - 1);
+            __builtin_prefetch(base + half + len / 2 - 1);
+            base += (base[half - 1] < val) * half;
+        }
+        return *base == val;
+    }
+
+    /**
+     * Linear scan over the unmerged tail. Written without early exit so
+     * that the compiler can vectorize it.
+     */
+    bool scan_tail(dtype val) const {
+        // An int accumulator, since GCC does not vectorize |= on bool.
+        int found = 0;
+        const dtype* p = data_.data();
+        for (size_t i = sorted_; i < data_.size(); ++i) {
+            found |= p[i] == val;
+        }
+        return found;
+    }
+
+   public:
+    /**
+     * Inserts all of [begin, end) at once. Into an empty set this is a
+     * single (parallel, if there are threads) sort and deduplication, which
+     * leaves the whole set sorted for the queries that follow.
+     *
+     * @param pool Threads to use, or nullptr.
+     */
+    void build_from(const dtype* begin, const dtype* end, thread_pool* pool) {
+        if (!data_.empty()) {
+            for (const dtype* p = begin; p < end; ++p) insert(*p);
+            return;
+        }
+        constexpr size_t parallel_min = size_t(1) << 16;
+        data_.assign(begin, end);
+        size_t n = data_.size();
+        if (!std::is_sorted(data_.begin(), data_.end())) {
+            if (pool != nullptr && pool->size() > 1 && n >= parallel_min) {
+                std::vector<dtype> buf(n);
+                if (parallel_sort(*pool, data_.data(), n, buf.data()) !=
+                    data_.data()) {
+                    data_.swap(buf);
+                }
+            } else {
+                std::sort(data_.begin(), data_.end());
+            }
+        }
+        // Puts the tail (all of data_) in place, which for sorted data is
+        // just the deduplication.
+        in_order_ = true;
+        merge_tail();
+    }
+
+    /**
+     * Appends val to the unsorted tail.
+     *
+     * @param val Element to be inserted.
+     */
+    void insert(dtype val) {
+        in_order_ &= data_.empty() || data_.back() <= val;
+        data_.push_back(val);
+    }
+
+    /**
+     * Removes val, from the sorted prefix and from the tail.
+     *
+     * @param val Element to be removed.
+     */
+    void erase(dtype val) {
+        auto mid = data_.begin() + sorted_;
+        auto it = std::lower_bound(data_.begin(), mid, val);
+        if (it != mid && *it == val) {
+            data_.erase(it);
+            --sorted_;
+        }
+        // What is left of the tail keeps its order, so in_order_ holds.
+        data_.erase(std::remove(data_.begin() + sorted_, data_.end(), val),
+                    data_.end());
+    }
+
+    /**
+     * Adds the values of other. See include/set_ops.hpp.
+     */
+    void unite(const vs& other) {
+        merge_with(other, [](auto... args) { std::set_union(args...); });
+    }
+
+    /**
+     * Keeps only the values that are also in other.
+     */
+    void intersect(const vs& other) {
+        merge_with(other,
+                   [](auto... args) { std::set_intersection(args...); });
+    }
 
+    /**
+     * Removes the values of other.
+     */
+    void subtract(const vs& other) {
+        merge_with(other, [](auto... args) { std::set_difference(args...); });
+    }
+
+    /**
+     * Checks if val is in the set, merging pending insertions first if
+     * there are too many of them to scan.
+     *
+     * Not const since it may reorganize the buffer.
+     *
+     * @param val The value to count the occurrences of.
+     * @return 1 if val is in the set, otherwise 0.
+     */
     int count(dtype val) {
-        return 0;
+        if (data_.size() - sorted_ > max_tail_) [[unlikely]] {
+            merge_tail();
+        }
+        return search(val) || scan_tail(val);
+    }
+
+    /**
+     * Merges all pending insertions. Until the next insert, count and
+     * count_batch then only read the set and can be called from several
+     * threads at once.
+     */
+    void freeze() {
+        if (data_.size() > sorted_) merge_tail();
+    }
+
+    /**
+     * Merges all pending insertions and stores the sorted array as the only
+     * section of a snapshot (see include/snapshot.hpp).
+     */
+    void save(snapshot_writer& w) {
+        freeze();
+        w.section();
+        w.append(data_.data(), data_.size() * sizeof(dtype));
+    }
+
+    /**
+     * Replaces the contents with the sorted array of a snapshot. The array
+     * is copied out of the mapping, since later insertions append to it.
+     * That is a single memcpy, still much cheaper than sorting.
+     *
+     * @return false iff the section is not a sorted array of dtype.
+     */
+    bool load(snapshot& s) {
+        size_t bytes = 0;
+        const dtype* p = static_cast<const dtype*>(s.section(0, bytes));
+        if (p == nullptr || bytes % sizeof(dtype) != 0) return false;
+        size_t n = bytes / sizeof(dtype);
+        if (std::adjacent_find(p, p + n, [](dtype a, dtype b) {
+                return a >= b;
+            }) != p + n) {
+            return false;
+        }
+        data_.assign(p, p + n);
+        sorted_ = n;
+        in_order_ = true;
+        max_tail_ = std::max(min_tail, size_t(4 * std::sqrt(double(n))));
+        return true;
+    }
+
+    /**
+     * @return Bytes the set takes (see include/mem_usage.hpp), including
+     *         the unmerged tail and the spare capacity of the vector.
+     */
+    size_t bytes_used() const {
+        return sizeof(*this) + detail::heap_bytes(data_);
+    }
+
+    /**
+     * Batched count, see batch.hpp. The branchless binary search always
+     * takes the same number of steps, so 16 searches run in lockstep. Each
+     * step prefetches the next probe of every search, which gives the memory
+     * system 16 independent loads to work on instead of one.
+     *
+     * @param vals Values to look up.
+     * @param n    Number of values.
+     * @param out  Output for the n results.
+     */
+    void count_batch(const dtype* vals, size_t n, uint8_t* out) {
+        if (data_.size() - sorted_ > max_tail_) [[unlikely]] {
+            merge_tail();
+        }
+        constexpr size_t lanes = 16;
+        const dtype* base[lanes];
+        for (size_t i = 0; i < n; i += lanes) {
+            size_t m = std::min(lanes, n - i);
+            const dtype* v = vals + i;
+            if (sorted_ == 0) {
+                for (size_t j = 0; j < m; ++j) out[i + j] = 0;
+            } else {
+                for (size_t j = 0; j < m; ++j) base[j] = data_.data();
+                size_t len = sorted_;
+                while (len > 1) {
+                    size_t half = len / 2;
+                    len -= half;
+                    for (size_t j = 0; j < m; ++j) {
+                        base[j] += (base[j][half - 1] < v[j]) * half;
+                        __builtin_prefetch(base[j] + len / 2 - 1);
+                    }
+                }
+                for (size_t j = 0; j < m; ++j) out[i + j] = *base[j] == v[j];
+            }
+            if (data_.size() > sorted_) {
+                for (size_t j = 0; j < m; ++j) out[i + j] |= scan_tail(v[j]);
+            }
+        }
     }
 };
 
@@ -0,0 +1,242 @@
+/**
+ * Buffered output sink for query results.
+ *
+ * Writing every result with std::cout << ... << std::endl flushes the stream
+ * once per query, so each result costs a write(2) system call. Here results
+ * are collected in a large buffer that is only written out when full and when
+ * the writer is destroyed.
+ *
+ * When the output goes to a pipe, write(2) blocks until the other end has
+ * read enough. In async mode full buffers are handed to an output thread
+ * instead, which writes them while the caller fills the next one.
+ */
+
+#pragma once
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "channel.hpp"
+
+namespace pfp {
+
+class writer {
+   private:
+    static constexpr size_t buffer_size = size_t(1) << 20;
+    // Buffers of the async mode, including the one being filled.
+    static constexpr size_t async_buffers = 4;
+
+    struct chunk {
+        std::unique_ptr<char[]> data;
+        size_t size = 0;
+    };
+
+    std::unique_ptr<char[]> buf_;
+    char* pos_;
+    // Leave room for one more text result (two bytes) before flushing.
+    char* limit_;
+    int fd_;
+    bool packed_;
+    uint8_t bits_ = 0;
+    unsigned n_bits_ = 0;
+    // Async mode only: buffers on their way to the output thread and back,
+    // and how many of them have been written.
+    std::unique_ptr<channel<chunk>> full_;
+    std::unique_ptr<channel<chunk>> empty_;
+    uint64_t handed_ = 0;
+    uint64_t written_ = 0;
+    std::mutex m_;
+    std::condition_variable written_cv_;
+    std::thread thread_;
+
+    static void write_out(int fd, const char* p, const char* end) {
+        while (p < end) {
+            ssize_t n = write(fd, p, end - p);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Nothing sensible to do if the output is gone.
+                break;
+            }
+            p += n;
+        }
+    }
+
+    /**
+     * Output thread of the async mode.
+     */
+    void work() {
+        while (std::unique_ptr<chunk> c = full_->pop()) {
+            write_out(fd_, c->data.get(), c->data.get() + c->size);
+            empty_->push(std::move(c));
+            {
+                std::lock_guard<std::mutex> lock(m_);
+                ++written_;
+            }
+            written_cv_.notify_all();
+        }
+    }
+
+    /**
+     * Passes the buffer on when it is full: written right away, or in async
+     * mode handed to the output thread in exchange for an empty one.
+     */
+    void spill() {
+        if (full_ == nullptr) {
+            flush();
+            return;
+        }
+        if (pos_ == buf_.get()) return;
+        std::unique_ptr<chunk> c = empty_->pop();
+        c->size = pos_ - buf_.get();
+        c->data.swap(buf_);
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            ++handed_;
+        }
+        full_->push(std::move(c));
+        pos_ = buf_.get();
+        limit_ = buf_.get() + buffer_size - 2;
+    }
+
+   public:
+    /**
+     * @param fd     File descriptor to write to. Not closed by the writer.
+     * @param packed If true, results are written as a bitmap with 8 results
+     *               per byte, least significant bit first. Otherwise as lines
+     *               of "0" or "1", the same as std::cout << count << '\n'.
+     * @param async  If true, a separate thread does the writing.
+     */
+    explicit writer(int fd, bool packed = false, bool async = false)
+        : buf_(new char[buffer_size]),
+          pos_(buf_.get()),
+          limit_(buf_.get() + buffer_size - 2),
+          fd_(fd),
+          packed_(packed) {
+        if (!async) return;
+        full_.reset(new channel<chunk>(async_buffers));
+        empty_.reset(new channel<chunk>(async_buffers));
+        for (size_t i = 1; i < async_buffers; ++i) {
+            std::unique_ptr<chunk> c(new chunk());
+            c->data.reset(new char[buffer_size]);
+            empty_->push(std::move(c));
+        }
+        thread_ = std::thread([this]() { work(); });
+    }
+
+    /**
+     * Writes any buffered results, including a final partially filled byte
+     * in packed mode.
+     */
+    ~writer() {
+        if (n_bits_ > 0) {
+            *pos_++ = char(bits_);
+            n_bits_ = 0;
+        }
+        flush();
+        if (full_ != nullptr) {
+            full_->close();
+            thread_.join();
+        }
+    }
+
+    writer(const writer&) = delete;
+    writer& operator=(const writer&) = delete;
+    writer(writer&&) = delete;
+    writer& operator=(writer&&) = delete;
+
+    /**
+     * Appends a single query result.
+     *
+     * @param found Result of the query.
+     */
+    void put(bool found) {
+        if (packed_) {
+            bits_ |= uint8_t(found) << n_bits_;
+            if (++n_bits_ < 8) [[likely]] {
+                return;
+            }
+            *pos_++ = char(bits_);
+            bits_ = 0;
+            n_bits_ = 0;
+        } else {
+            pos_[0] = '0' + found;
+            pos_[1] = '\n';
+            pos_ += 2;
+        }
+        if (pos_ >= limit_) [[unlikely]] {
+            spill();
+        }
+    }
+
+    /**
+     * Appends a number and a newline, for queries that answer with a value
+     * instead of found or not found. Always text, even in packed mode.
+     *
+     * @param v   The number to write.
+     * @param end Character after the number, e.g. ' ' to put several numbers
+     *            on one line.
+     */
+    void put_number(uint64_t v, char end = '\n') {
+        // The longest uint64_t has 20 digits.
+        if (limit_ + 2 - pos_ < 21) [[unlikely]] {
+            spill();
+        }
+        char digits[20];
+        char* d = digits + 20;
+        do {
+            *--d = char('0' + v % 10);
+            v /= 10;
+        } while (v > 0);
+        size_t len = digits + 20 - d;
+        std::memcpy(pos_, d, len);
+        pos_[len] = end;
+        pos_ += len + 1;
+        if (pos_ >= limit_) [[unlikely]] {
+            spill();
+        }
+    }
+
+    /**
+     * Appends text as it is, e.g. the "-1" markers of the operation files
+     * written by ./gen. Always text, even in packed mode.
+     *
+     * @param s   The text to write.
+     * @param len Length of s, at most 20.
+     */
+    void put_text(const char* s, size_t len) {
+        if (limit_ + 2 - pos_ < 21) [[unlikely]] {
+            spill();
+        }
+        std::memcpy(pos_, s, len);
+        pos_ += len;
+        if (pos_ >= limit_) [[unlikely]] {
+            spill();
+        }
+    }
+
+    /**
+     * Writes all complete buffered output with as few write(2) calls as the
+     * kernel allows. In async mode, waits until the output thread has
+     * written everything.
+     */
+    void flush() {
+        if (full_ == nullptr) {
+            write_out(fd_, buf_.get(), pos_);
+            pos_ = buf_.get();
+            return;
+        }
+        spill();
+        std::unique_lock<std::mutex> lock(m_);
+        written_cv_.wait(lock, [&]() { return written_ == handed_; });
+    }
+};
+
+}  // namespace pfp
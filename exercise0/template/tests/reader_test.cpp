@@ -0,0 +1,79 @@
+/**
+ * Tests for pfp::reader, run by "make test".
+ *
+ * Every check prints what went wrong and the program exits with 1 if any
+ * check failed.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include "../include/reader.hpp"
+
+namespace {
+
+int failures = 0;
+
+/**
+ * Reads all of text with a pfp::reader<dtype> and compares the tokens
+ * with the expected ones, which end with the token::end.
+ *
+ * @param kinds  Expected kinds of tokens.
+ * @param values Expected values of the tokens before the end.
+ */
+template <class dtype>
+void expect(const char* text, const pfp::token* kinds, const dtype* values) {
+    pfp::reader<dtype> in(text, std::strlen(text));
+    for (size_t i = 0;; ++i) {
+        dtype val = 0;
+        pfp::token t = in.next(val);
+        if (t != kinds[i] || (t != pfp::token::end && val != values[i])) {
+            std::cerr << "\"" << text << "\": token " << i << " is wrong"
+                      << std::endl;
+            ++failures;
+            return;
+        }
+        if (t == pfp::token::end) return;
+    }
+}
+
+}  // namespace
+
+int main() {
+    using pfp::token;
+    const token value_end[] = {token::value, token::end};
+    const token end[] = {token::end};
+
+    // Values that fit.
+    const int i_max[] = {2147483647};
+    expect<int>("2147483647", value_end, i_max);
+    const int64_t l_max[] = {INT64_MAX};
+    expect<int64_t>("9223372036854775807\n", value_end, l_max);
+    const token marker_end[] = {token::marker, token::end};
+    const int64_t l_marker[] = {-INT64_MAX};
+    expect<int64_t>("-9223372036854775807", marker_end, l_marker);
+
+    // Values that are too large end the input, like with operator>>, both
+    // after a value and as a marker. They must not wrap around.
+    const int one[] = {1};
+    expect<int>("1 3000000000 5", value_end, one);
+    expect<int>("2147483648", end, one);
+    expect<int>("-3000000000 1", end, one);
+    expect<int>("4294967297", end, one);
+    const int64_t none[] = {0};
+    expect<int64_t>("9223372036854775808", end, none);
+    expect<int64_t>("18446744073709551617", end, none);
+    // Digit runs that do not even fit 64 bits, scalar and SIMD scanned.
+    expect<int64_t>("1844674407370955161600000", end, none);
+    expect<int>("00000000000000000000000000000000000000000001", value_end,
+                one);
+    expect<int64_t>("99999999999999999999999999999999999999999999", end, none);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All reader tests passed" << std::endl;
+    return 0;
+}